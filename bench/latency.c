@@ -0,0 +1,276 @@
+/* Measures how long it takes from a key press until its echo is on the
+ * screen, in an idle terminal and in one that's busy with a flood of
+ * output.
+ *
+ * We start eduterm with ourselves as the child ("--child"). The child
+ * puts the terminal in raw mode, keeps the first line for itself and
+ * echoes every key it reads into the top left cell. In the flood run, it
+ * also prints lines as fast as it can, scrolling the rest of the screen.
+ *
+ * The parent fakes key presses through XTest and polls the top left cell
+ * with XGetImage() until it changes. It types 'a' and 'b' in turns, so
+ * every key press changes that cell.
+ *
+ * Needs an X server to itself, see "make bench-latency". */
+#define _GNU_SOURCE
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XTest.h>
+#include <X11/keysym.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIMEOUT_MS 1000
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void put(const char *s, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(1, s, n);
+        if (w <= 0)
+            return;
+        s += w;
+        n -= w;
+    }
+}
+
+/* Runs inside eduterm. Everything but the first line is a scroll region
+ * for the flood, the echo goes to the first line. */
+static int child(bool flood)
+{
+    struct termios t;
+    struct winsize ws;
+    char           buf[128];
+    const char    *line =
+        "flood flood flood flood flood flood flood flood flood flood flood\r\n";
+
+    tcgetattr(0, &t);
+    cfmakeraw(&t);
+    tcsetattr(0, TCSANOW, &t);
+    if (ioctl(0, TIOCGWINSZ, &ws) == -1 || ws.ws_row == 0)
+        ws.ws_row = 45;
+
+    int n = snprintf(buf, sizeof(buf), "\033[2;%dr\033[%d;1H", ws.ws_row,
+                     ws.ws_row);
+    put(buf, n);
+
+    for (;;) {
+        struct pollfd pfd = {.fd = 0, .events = POLLIN};
+
+        if (poll(&pfd, 1, flood ? 0 : -1) > 0) {
+            char keys[64];
+            ssize_t k = read(0, keys, sizeof(keys));
+
+            if (k <= 0)
+                return 0;
+
+            for (ssize_t i = 0; i < k; i++) {
+                n = snprintf(buf, sizeof(buf), "\033[1;1H%c\033[%d;1H",
+                             keys[i], ws.ws_row);
+                put(buf, n);
+            }
+        }
+
+        if (flood)
+            put(line, strlen(line));
+    }
+}
+
+// eduterm doesn't set WM_NAME, only _NET_WM_NAME
+static Window find_window(Display *dpy)
+{
+    Atom   net_wm_name = XInternAtom(dpy, "_NET_WM_NAME", False);
+    Window root = DefaultRootWindow(dpy), parent, *children, found = None;
+    unsigned int n;
+
+    if (!XQueryTree(dpy, root, &root, &parent, &children, &n))
+        return None;
+
+    for (unsigned int i = 0; i < n && found == None; i++) {
+        Atom           type;
+        int            format;
+        unsigned long  len, after;
+        unsigned char *name = NULL;
+
+        if (XGetWindowProperty(dpy, children[i], net_wm_name, 0, 64, False,
+                               AnyPropertyType, &type, &format, &len, &after,
+                               &name) == Success && name != NULL &&
+            strncmp((char *)name, "eduterm", 7) == 0)
+            found = children[i];
+        XFree(name);
+    }
+
+    XFree(children);
+    return found;
+}
+
+/* Ends the eduterm of a run, and waits for its window to go. Otherwise
+ * the next run could find that window, on its way out, instead of its
+ * own. False if it doesn't. */
+static bool stop(Display *dpy, pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    for (double start = now_ms(); now_ms() - start < 5000;) {
+        if (find_window(dpy) == None)
+            return true;
+        usleep(10000);
+    }
+    fprintf(stderr, "eduterm window did not go away\n");
+    return false;
+}
+
+static bool same_image(XImage *a, XImage *b)
+{
+    return memcmp(a->data, b->data, a->bytes_per_line * a->height) == 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static bool run(Display *dpy, const char *eduterm, const char *self,
+                bool flood, int samples)
+{
+    char   cmd[4096];
+    pid_t  pid;
+    Window win = None;
+
+    snprintf(cmd, sizeof(cmd), "%s --child%s", self, flood ? " flood" : "");
+
+    pid = fork();
+    if (pid == 0) {
+        // eduterm is chatty on stdout
+        if (freopen("/dev/null", "w", stdout) == NULL)
+            _exit(1);
+        execl(eduterm, eduterm, "--exec", cmd, "--blink-idle", "1", NULL);
+        perror("execl");
+        _exit(1);
+    }
+    else if (pid == -1) {
+        perror("fork");
+        return false;
+    }
+
+    for (double start = now_ms(); now_ms() - start < 5000;) {
+        if ((win = find_window(dpy)) != None)
+            break;
+        usleep(10000);
+    }
+
+    if (win == None) {
+        fprintf(stderr, "eduterm window did not show up\n");
+        stop(dpy, pid);
+        return false;
+    }
+
+    XWindowAttributes wa;
+    XGetWindowAttributes(dpy, win, &wa);
+
+    // eduterm is 80x45 cells
+    int cw = wa.width / 80, ch = wa.height / 45;
+
+    // let the child set up and the cursor stop blinking
+    usleep(1500000);
+    XSetInputFocus(dpy, win, RevertToParent, CurrentTime);
+
+    KeyCode keys[2] = {XKeysymToKeycode(dpy, XK_a),
+                       XKeysymToKeycode(dpy, XK_b)};
+    double *lat  = malloc(samples * sizeof(lat[0]));
+    int     got  = 0, lost = 0;
+    XImage *prev = XGetImage(dpy, win, 0, 0, cw, ch, AllPlanes, ZPixmap);
+
+    for (int i = 0; i < samples; i++) {
+        XImage *img = NULL;
+        double  t0  = now_ms();
+
+        XTestFakeKeyEvent(dpy, keys[i % 2], True, CurrentTime);
+        XTestFakeKeyEvent(dpy, keys[i % 2], False, CurrentTime);
+        XFlush(dpy);
+
+        while (now_ms() - t0 < TIMEOUT_MS) {
+            img = XGetImage(dpy, win, 0, 0, cw, ch, AllPlanes, ZPixmap);
+            if (!same_image(img, prev))
+                break;
+            XDestroyImage(img);
+            img = NULL;
+        }
+
+        if (img != NULL) {
+            lat[got++] = now_ms() - t0;
+            XDestroyImage(prev);
+            prev = img;
+        }
+        else {
+            lost++;
+        }
+
+        usleep(5000 + rand() % 10000);
+    }
+
+    XDestroyImage(prev);
+    bool gone = stop(dpy, pid);
+
+    qsort(lat, got, sizeof(lat[0]), cmp_double);
+    printf("%-6s n=%d lost=%d", flood ? "flood" : "idle", got, lost);
+    if (got > 0)
+        printf("  p50=%.2fms p99=%.2fms max=%.2fms", lat[got / 2],
+               lat[(int)(got * 0.99)], lat[got - 1]);
+    printf("\n");
+
+    free(lat);
+    return gone;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "--child") == 0)
+        return child(argc >= 3 && strcmp(argv[2], "flood") == 0);
+
+    const char *eduterm = argc >= 2 ? argv[1] : "./eduterm";
+    int         samples = argc >= 3 ? atoi(argv[2]) : 200;
+    char        self[4096];
+    ssize_t     n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+
+    if (n == -1) {
+        perror("readlink");
+        return 1;
+    }
+    self[n] = '\0';
+
+    Display *dpy = XOpenDisplay(NULL);
+    if (dpy == NULL) {
+        fprintf(stderr, "Cannot open display\n");
+        return 1;
+    }
+
+    int ev, err, major, minor;
+    if (!XTestQueryExtension(dpy, &ev, &err, &major, &minor)) {
+        fprintf(stderr, "No XTest on this display\n");
+        return 1;
+    }
+
+    if (!run(dpy, eduterm, self, false, samples) ||
+        !run(dpy, eduterm, self, true, samples))
+        return 1;
+
+    return 0;
+}
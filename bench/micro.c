@@ -0,0 +1,380 @@
+/* Timings of the functions that touch the grid cell by cell, each one on
+ * its own, no X server involved.
+ *
+ * Every kernel is warmed up first, then timed over RUNS runs of as many
+ * iterations as it takes for a run to be long enough to measure. We
+ * report the median over the runs and the median absolute deviation
+ * (MAD), both per cell (or per glyph, or per escape sequence, whatever
+ * the kernel works on). On x86, the unit is TSC cycles, elsewhere it's
+ * nanoseconds.
+ *
+ * The inputs are random, but always the same: the generator has a fixed
+ * seed.
+ *
+ * eduterm prints a trace of what it does to stdout, which would drown
+ * out what we're after. So printf() and putchar() are stubbed out in
+ * the eduterm.c we include here. */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+
+static int quiet_printf(const char *fmt, ...)
+{
+    (void)fmt;
+    return 0;
+}
+
+static int quiet_putchar(int c)
+{
+    return c;
+}
+
+#define printf  quiet_printf
+#define putchar quiet_putchar
+#define main    eduterm_main
+#include "../eduterm.c"
+#undef main
+#undef printf
+#undef putchar
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICKS "cycles"
+static uint64_t ticks(void)
+{
+    return __rdtsc();
+}
+#else
+#define TICKS "ns"
+static uint64_t ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+#define RUNS      31
+#define RUN_TICKS 2000000  // make a run at least this long
+#define NCSI      64
+
+static struct X11  x11;
+static uint64_t    rng = 0x2545f4914f6cdd1dull;
+static struct cell row_a[512], row_b[512];
+static char        text[4096];
+static wchar_t     glyphs[4096 + 1];
+static size_t      text_glyphs;
+static struct csi  csi_ich[NCSI], csi_dch[NCSI], csi_il[NCSI], csi_dl[NCSI];
+static struct csi  csi_sgr[NCSI];
+static int         csi_x[NCSI], csi_y[NCSI];
+static unsigned    next_csi;
+static volatile bool sink;
+
+// xorshift64, good enough and the same everywhere
+static uint64_t rnd(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static size_t put_utf8(char *out, uint32_t cp)
+{
+    if (cp < 0x800) {
+        out[0] = 0xc0 | cp >> 6;
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xe0 | cp >> 12;
+        out[1] = 0x80 | (cp >> 6 & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | cp >> 18;
+    out[1] = 0x80 | (cp >> 12 & 0x3f);
+    out[2] = 0x80 | (cp >> 6 & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+static void parse_csi(struct csi *csi, const char *s)
+{
+    csi_reset(csi);
+    while (!csi_feed(csi, *s++))
+        ;
+}
+
+static void fill_screen(void)
+{
+    for (int y = 0; y < x11.buf_h; y++) {
+        x11.buf_y = y;
+        for (x11.buf_x = 0; x11.buf_x < x11.buf_w; x11.buf_x++)
+            putch(&x11, 'a' + rnd() % 26);
+    }
+    x11.buf_x = x11.buf_y = 0;
+}
+
+static void setup(void)
+{
+    char buf[64];
+
+    if (!term_setup(&x11))
+        exit(1);
+    for (int i = 0; i < 256; i++)
+        x11.col_256[i] = i;
+    for (int i = 0; i < (int)col_os_length; i++)
+        x11.col_os[i] = i;
+
+    for (int x = 0; x < x11.buf_w; x++) {
+        row_a[x] = row_b[x] = x11.blank;
+        row_a[x].g = row_b[x].g = 'a' + rnd() % 26;
+    }
+
+    // mostly ASCII, with some two, three and four byte sequences
+    for (size_t i = 0; i < sizeof(text) - 4;) {
+        unsigned r = rnd() % 100;
+        if (r < 85) {
+            text[i++] = ' ' + rnd() % 95;
+        }
+        else if (r < 93) {
+            i += put_utf8(text + i, 0x80 + rnd() % 0x780);
+        }
+        else if (r < 99) {
+            i += put_utf8(text + i, 0x800 + rnd() % 0x7000);
+        }
+        else {
+            i += put_utf8(text + i, 0x10000 + rnd() % 0x10000);
+        }
+    }
+
+    for (int i = 0; i < NCSI; i++) {
+        csi_x[i] = rnd() % x11.buf_w;
+        csi_y[i] = rnd() % x11.buf_h;
+
+        snprintf(buf, sizeof(buf), "%d@", (int)(1 + rnd() % 8));
+        parse_csi(&csi_ich[i], buf);
+        snprintf(buf, sizeof(buf), "%dP", (int)(1 + rnd() % 8));
+        parse_csi(&csi_dch[i], buf);
+        snprintf(buf, sizeof(buf), "%dL", (int)(1 + rnd() % 4));
+        parse_csi(&csi_il[i], buf);
+        snprintf(buf, sizeof(buf), "%dM", (int)(1 + rnd() % 4));
+        parse_csi(&csi_dl[i], buf);
+
+        switch (rnd() % 4) {
+          case 0:
+            snprintf(buf, sizeof(buf), "0;%d;%dm", 30 + (int)(rnd() % 8),
+                     40 + (int)(rnd() % 8));
+            break;
+          case 1:
+            snprintf(buf, sizeof(buf), "1;3;9%dm", (int)(rnd() % 8));
+            break;
+          case 2:
+            snprintf(buf, sizeof(buf), "38;5;%d;48;5;%dm",
+                     (int)(rnd() % 256), (int)(rnd() % 256));
+            break;
+          default:
+            snprintf(buf, sizeof(buf), "38;2;%d;%d;%dm", (int)(rnd() % 256),
+                     (int)(rnd() % 256), (int)(rnd() % 256));
+        }
+        parse_csi(&csi_sgr[i], buf);
+    }
+
+    fill_screen();
+}
+
+static void k_putch(void)
+{
+    x11.buf_y = 0;
+    for (x11.buf_x = 0; x11.buf_x < x11.buf_w; x11.buf_x++)
+        putch(&x11, 'a' + (x11.buf_x & 15));
+    x11.buf_x = 0;
+}
+
+static void k_clear_cells(void)
+{
+    struct cell *c = row_mut(&x11, 1)->cells;
+    clear_cells(&x11, c, c + x11.buf_w);
+}
+
+static void k_copy(void)
+{
+    for (int x = 0; x < x11.buf_w; x++)
+        copy(row_b + x, row_a + x);
+}
+
+static void k_equals(void)
+{
+    bool all = true;
+    for (int x = 0; x < x11.buf_w; x++)
+        all &= equals(row_a + x, row_b + x);
+    sink = all;
+}
+
+/* Rows that scroll or are pushed out of the screen are put back in place
+ * of the blank ones that come in. Otherwise the screen would be nothing
+ * but the shared blank row after a few iterations, and we'd time the
+ * cheap way of moving that around. */
+static void keep_rows(int y, int n, struct row **kept)
+{
+    for (int i = 0; i < n; i++)
+        kept[i] = row_ref(x11.rows[y + i]);
+}
+
+static void put_back(int y, int n, struct row **kept)
+{
+    for (int i = 0; i < n; i++) {
+        row_release(x11.rows[y + i]);
+        x11.rows[y + i] = kept[i];
+    }
+}
+
+static void k_scroll_up(void)
+{
+    struct row *kept[1];
+
+    keep_rows(x11.scr_begin, 1, kept);
+    scroll_up(&x11);
+    put_back(x11.scr_end, 1, kept);
+}
+
+static void k_utf8_decode(void)
+{
+    struct utf8 st = {0};
+    size_t      n;
+
+    utf8_decode(&st, text, sizeof(text), glyphs, &n);
+    sink = n == 0;
+}
+
+static void k_utf32_to_utf8(void)
+{
+    static char out[sizeof(glyphs)];
+
+    sink = utf32_to_utf8(glyphs, text_glyphs, out) == 0;
+}
+
+static void k_csi(struct csi *csis)
+{
+    unsigned i = next_csi++ % NCSI;
+
+    x11.buf_x = csi_x[i];
+    x11.buf_y = csi_y[i];
+    process_csi(&csis[i], &x11, NULL);
+}
+
+// how many rows the next of csis inserts or deletes, and where
+static int csi_rows(struct csi *csis, int *y)
+{
+    unsigned i = next_csi % NCSI;
+    int      n = csi_arg(&csis[i], 0, 1);
+
+    *y = csi_y[i];
+    return n < x11.scr_end - *y + 1 ? n : x11.scr_end - *y + 1;
+}
+
+static void k_ich(void)
+{
+    k_csi(csi_ich);
+}
+
+static void k_dch(void)
+{
+    k_csi(csi_dch);
+}
+
+/* A line in and a line out. Which rows the sequences are going to drop
+ * depends on where they go, so they're kept before and put back after,
+ * see keep_rows(). */
+static void k_il_dl(void)
+{
+    struct row *kept[4];  // csi_il and csi_dl move no more than that
+    int         y, n;
+
+    n = csi_rows(csi_il, &y);
+    keep_rows(x11.scr_end - n + 1, n, kept);
+    k_csi(csi_il);
+    put_back(y, n, kept);
+
+    n = csi_rows(csi_dl, &y);
+    keep_rows(y, n, kept);
+    k_csi(csi_dl);
+    put_back(x11.scr_end - n + 1, n, kept);
+}
+
+static void k_sgr(void)
+{
+    process_csi(&csi_sgr[next_csi++ % NCSI], &x11, NULL);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void measure(const char *name, void (*fn)(void), double units,
+                    const char *unit)
+{
+    uint64_t samples[RUNS], dev[RUNS];
+    size_t   iters = 1;
+
+    // warm up, and find out how many iterations make a run long enough
+    for (;;) {
+        uint64_t t0 = ticks();
+        for (size_t i = 0; i < iters; i++)
+            fn();
+        if (ticks() - t0 >= RUN_TICKS)
+            break;
+        iters *= 2;
+    }
+
+    for (int r = 0; r < RUNS; r++) {
+        uint64_t t0 = ticks();
+        for (size_t i = 0; i < iters; i++)
+            fn();
+        samples[r] = ticks() - t0;
+    }
+
+    qsort(samples, RUNS, sizeof(samples[0]), cmp_u64);
+    uint64_t median = samples[RUNS / 2];
+
+    for (int r = 0; r < RUNS; r++)
+        dev[r] = samples[r] > median ? samples[r] - median
+                                     : median - samples[r];
+    qsort(dev, RUNS, sizeof(dev[0]), cmp_u64);
+
+    double per = (double)iters * units;
+    printf("%-14s %10.2f %s/%-6s MAD %8.2f %10.1f %s/call\n", name,
+           median / per, TICKS, unit, dev[RUNS / 2] / per,
+           (double)median / iters, TICKS);
+}
+
+int main(void)
+{
+    setup();
+
+    struct utf8 st = {0};
+    utf8_decode(&st, text, sizeof(text), glyphs, &text_glyphs);
+
+    double w = x11.buf_w, h = x11.buf_h;
+
+    printf("%dx%d cells, median of %d runs\n", x11.buf_w, x11.buf_h, RUNS);
+
+    measure("putch", k_putch, w, "cell");
+    measure("clear_cells", k_clear_cells, w, "cell");
+    measure("copy", k_copy, w, "cell");
+    measure("equals", k_equals, w, "cell");
+    measure("scroll_up", k_scroll_up, w * h, "cell");
+    fill_screen();
+    measure("utf8_decode", k_utf8_decode, text_glyphs, "glyph");
+    measure("utf32_to_utf8", k_utf32_to_utf8, text_glyphs, "glyph");
+    measure("csi @", k_ich, w, "cell");
+    measure("csi P", k_dch, w, "cell");
+    fill_screen();
+    measure("csi L+M", k_il_dl, w * h, "cell");
+    measure("csi m (SGR)", k_sgr, 1, "seq");
+
+    return 0;
+}
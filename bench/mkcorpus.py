@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+"""Writes the byte streams "make pgo" trains the compiler on, into the
+directory given on the command line:
+
+  compiler  a build log: make, GCC diagnostics in color, caret lines
+  vim       editing in vim: alternate screen, scroll regions, inserted
+            and deleted lines and characters, syntax colors, status line
+  tui       a top-like dashboard: full screen repaints by cursor address,
+            256 colors and true color, box drawing, synchronized updates
+  utf8      text in many scripts, wide CJK, combining marks, emoji with
+            ZWJ sequences and long lines that wrap
+
+They're what eduterm would get from the pty in those situations, made
+of the escape sequences such programs actually send. Every generator
+yields its stream a piece at a time, forever, and main() cuts it off
+after SIZE bytes. The random generators have fixed seeds, so the corpus
+is the same on every run and every machine."""
+
+import os
+import random
+import sys
+
+SIZE = 4 << 20  # bytes per stream, roughly
+COLS, ROWS = 80, 45
+
+ESC = "\033"
+CSI = ESC + "["
+
+WORDS = ("the of and to in is it that for on with as was at by this from "
+         "buffer parser cell row glyph cursor screen window color escape "
+         "sequence terminal render redraw scroll region insert delete "
+         "line column width height offset length count value index size "
+         "static const struct unsigned return while break continue").split()
+
+IDENTS = ("x11 pty buf csi cell row glyph n i len cur dpy win gc ev p t "
+          "tabs tab_feed process_csi putch scroll_up clear_cells "
+          "utf8_decode x11_redraw term_setup").split()
+
+
+def words(rng, n):
+    return " ".join(rng.choice(WORDS) for _ in range(n))
+
+
+def compiler(rng):
+    files = ["src/%s/%s.c" % (rng.choice(["core", "net", "ui", "util"]),
+                              rng.choice(IDENTS)) for _ in range(40)]
+    while True:
+        out = []
+        f = rng.choice(files)
+        out.append("gcc -std=c11 -Wall -Wextra -O2 -g -Iinclude -c -o %s %s"
+                   "\r\n" % (f[:-2] + ".o", f))
+        for _ in range(rng.randrange(4)):
+            line, col = rng.randrange(1, 3000), rng.randrange(1, 60)
+            kind, color = rng.choice([("warning", "35"), ("error", "31"),
+                                      ("note", "36")])
+            out.append(CSI + "01m" + CSI + "K%s:%d:%d:" % (f, line, col) +
+                       CSI + "m" + CSI + "K " + CSI + "01;%sm" % color +
+                       CSI + "K%s: " % kind + CSI + "m" + CSI + "K" +
+                       "%s '" % words(rng, rng.randrange(3, 9)) +
+                       CSI + "01m" + CSI + "K%s" % rng.choice(IDENTS) +
+                       CSI + "m" + CSI + "K' [" + CSI + "01;%sm" % color +
+                       CSI + "K-W%s" % rng.choice(WORDS) + CSI + "m" +
+                       CSI + "K]\r\n")
+            src = "    %s = %s(%s, %s);" % (rng.choice(IDENTS),
+                                            rng.choice(IDENTS),
+                                            rng.choice(IDENTS),
+                                            rng.choice(IDENTS))
+            out.append(" %4d | %s\r\n" % (line, src))
+            out.append("      | " + " " * min(col, len(src)) +
+                       CSI + "01;%sm" % color + CSI + "K^" +
+                       "~" * rng.randrange(12) + CSI + "m" + CSI + "K\r\n")
+        if rng.random() < 0.02:
+            out.append("make[%d]: Leaving directory '/home/user/src/%s'\r\n"
+                       % (rng.randrange(1, 4), rng.choice(IDENTS)))
+        yield "".join(out)
+
+
+def vim_line(rng, n):
+    colors = ["38;5;130", "38;5;21", "38;5;28", "1;38;5;94", "38;5;90"]
+    line = [CSI + "%d;1H" % n, CSI + "38;5;130m%4d " % n, CSI + "m"]
+    for _ in range(rng.randrange(0, 8)):
+        line.append(CSI + rng.choice(colors) + "m" + rng.choice(IDENTS +
+                                                               WORDS))
+        line.append(CSI + "m" + rng.choice([" ", "(", ", ", "; ", " = "]))
+    line.append(CSI + "K")
+    return "".join(line)
+
+
+def vim(rng):
+    yield (CSI + "?1049h" + CSI + "22;0;0t" + CSI + "?1h" + ESC + "=" +
+           CSI + "H" + CSI + "2J")
+    status = (CSI + "%d;1H" % ROWS + CSI + "7m %s  [+]" % "eduterm.c" +
+              " " * 50 + "%d,%d  %d%% " + CSI + "27m")
+    while True:
+        out = [CSI + "?25l"]
+        action = rng.random()
+        if action < 0.3:
+            # typing: insert characters in the middle of a line
+            y, x = rng.randrange(1, ROWS - 1), rng.randrange(6, COLS - 10)
+            out.append(CSI + "%d;%dH" % (y, x))
+            for ch in rng.choice(IDENTS):
+                out.append(CSI + "@" + ch)
+        elif action < 0.45:
+            # deleting characters
+            y, x = rng.randrange(1, ROWS - 1), rng.randrange(6, COLS - 10)
+            out.append(CSI + "%d;%dH" % (y, x) +
+                       CSI + "%dP" % rng.randrange(1, 6))
+        elif action < 0.65:
+            # opening or deleting lines, inside the text area
+            y = rng.randrange(1, ROWS - 2)
+            out.append(CSI + "1;%dr" % (ROWS - 1) + CSI + "%d;1H" % y)
+            out.append(CSI + "%d%s" % (rng.randrange(1, 4), rng.choice("LM")))
+            out.append(CSI + "r")
+            out.append(vim_line(rng, y))
+        elif action < 0.85:
+            # scrolling with ^E / ^D: scroll the region, draw the new lines
+            n = rng.randrange(1, 20)
+            out.append(CSI + "1;%dr" % (ROWS - 1) + CSI + "%d;1H" %
+                       (ROWS - 1) + "\n" * n + CSI + "r")
+            for y in range(ROWS - 1 - n, ROWS - 1):
+                out.append(vim_line(rng, y))
+        else:
+            # redraw everything, as after ^L or a jump
+            out.append(CSI + "H" + CSI + "2J")
+            for y in range(1, ROWS):
+                out.append(vim_line(rng, y))
+        out.append(status % (rng.randrange(1, 3000), rng.randrange(1, 80),
+                             rng.randrange(100)))
+        out.append(CSI + "%d;%dH" % (rng.randrange(1, ROWS),
+                                     rng.randrange(1, COLS)))
+        out.append(CSI + "?25h")
+        yield "".join(out)
+
+
+def tui(rng):
+    yield CSI + "?1049h" + CSI + "?25l"
+    while True:
+        out = [CSI + "?2026h" + CSI + "H"]
+        # meters at the top, as bars of block elements
+        for cpu in range(8):
+            used = rng.randrange(COLS // 2 - 10)
+            out.append(CSI + "%d;1H" % (cpu + 1) +
+                       CSI + "38;5;%dm%2d" % (44, cpu) + CSI + "m[" +
+                       CSI + "38;2;%d;%d;0m" % (min(255, used * 8),
+                                                 255 - min(255, used * 8)) +
+                       "█" * used + "▌" + CSI + "m" +
+                       " " * (COLS // 2 - 10 - used) + "%5.1f%%]"
+                       % (rng.random() * 100))
+        # a box with the process list
+        out.append(CSI + "10;1H" + CSI + "38;5;240m┌" +
+                   "─" * (COLS - 2) + "┐")
+        out.append(CSI + "11;1H│" + CSI + "30;46m" +
+                   "  PID USER      PRI  NI  VIRT   RES  CPU% MEM% "
+                   "COMMAND".ljust(COLS - 2) + CSI + "m" +
+                   CSI + "38;5;240m│")
+        for y in range(12, ROWS - 1):
+            sel = rng.random() < 0.03
+            out.append(CSI + "%d;1H" % y + CSI + "38;5;240m│" + CSI + "m")
+            if sel:
+                out.append(CSI + "48;2;40;60;120m")
+            out.append("%5d " % rng.randrange(1, 99999) +
+                       CSI + "38;5;%dm%-9s" % (rng.randrange(16, 232),
+                                              rng.choice(["root", "user",
+                                                          "daemon"])) +
+                       CSI + "39m %3d %3d %5dM %4dM " % (
+                           rng.randrange(40), rng.randrange(-20, 20),
+                           rng.randrange(9999), rng.randrange(999)) +
+                       CSI + "1m%5.1f" % (rng.random() * 100) + CSI + "22m" +
+                       " %4.1f " % (rng.random() * 10) +
+                       rng.choice(IDENTS)[:COLS - 48].ljust(COLS - 48))
+            out.append(CSI + "m" + CSI + "38;5;240m│" + CSI + "m")
+        out.append(CSI + "%d;1H" % (ROWS - 1) + CSI + "38;5;240m└" +
+                   "─" * (COLS - 2) + "┘" + CSI + "m")
+        out.append(CSI + "%d;1H" % ROWS)
+        for key, label in [("F1", "Help"), ("F2", "Setup"), ("F3", "Search"),
+                           ("F9", "Kill"), ("F10", "Quit")]:
+            out.append(key + CSI + "30;46m" + label.ljust(6) + CSI + "m")
+        out.append(CSI + "K")
+        out.append(CSI + "?2026l")
+        yield "".join(out)
+
+
+def utf8(rng):
+    scripts = [
+        "Ünïcödé façade naïve résumé coöperate Ångström",
+        "Быстрая коричневая лиса перепрыгивает через ленивую собаку",
+        "Γρήγορη καφέ αλεπού πηδάει πάνω από τον τεμπέλη σκύλο",
+        "דג סקרן שט בים מאוכזב ולפתע מצא חברה",
+        "نص حكيم له سر قاطع وذو شأن عظيم مكتوب على ثوب أخضر",
+        "सभी मनुष्यों को गौरव और अधिकारों के मामले में जन्मजात स्वतन्त्रता",
+        "ภาษาไทยมีวรรณยุกต์และสระที่ซ้อนกันอยู่",
+        "日本語のテキストは全角で二つのセルを使います",
+        "中文字符在终端中占用两个单元格的宽度",
+        "한국어 텍스트도 넓은 문자로 표시됩니다",
+        "é ä ô ñ combining marks stack up",
+        "emoji \U0001f600 \U0001f44d\U0001f3fd \U0001f468‍\U0001f469"
+        "‍\U0001f467 \U0001f1e9\U0001f1ea ❤️",
+        "box ┌─┐ │ └─┘ "
+        "arrows ←↑→↓ math ∀∃∈∞",
+    ]
+    while True:
+        line = " ".join(rng.choice(scripts)
+                        for _ in range(rng.randrange(1, 5)))
+        if rng.random() < 0.2:
+            line = CSI + "3%dm" % rng.randrange(1, 8) + line + CSI + "m"
+        yield line + "\r\n"
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: mkcorpus.py DIR")
+
+    os.makedirs(sys.argv[1], exist_ok=True)
+    for gen in (compiler, vim, tui, utf8):
+        rng = random.Random(gen.__name__)
+        size = 0
+        with open(os.path.join(sys.argv[1], gen.__name__), "wb") as f:
+            for chunk in gen(rng):
+                data = chunk.encode("utf-8")
+                f.write(data)
+                size += len(data)
+                if size >= SIZE:
+                    break
+
+
+if __name__ == "__main__":
+    main()
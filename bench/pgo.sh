@@ -0,0 +1,54 @@
+#!/bin/sh
+# Builds ./eduterm with profile-guided and link-time optimization, see
+# "make pgo", which hands us CC, CFLAGS, LDFLAGS and LDLIBS.
+#
+# An instrumented eduterm replays the corpus from bench/mkcorpus.py, so
+# that GCC learns which branches of the parser real output takes. Then
+# eduterm is built again with that profile and -flto. Both that and a
+# plain build replay the corpus RUNS times, and we report the best time
+# of each and the speedup.
+#
+# Everything but the final binary ends up in pgo/.
+set -e
+
+dir=pgo
+corpus=$dir/corpus
+runs=${RUNS:-5}
+
+mkdir -p $dir
+python3 bench/mkcorpus.py $corpus
+
+$CC $CFLAGS $LDFLAGS -o $dir/eduterm-plain eduterm.c $LDLIBS
+
+# GCC finds the profile by the name of the object file, so that name
+# stays the same through both builds.
+rm -f $dir/*.gcda
+$CC $CFLAGS -fprofile-generate -c -o $dir/eduterm.o eduterm.c
+$CC $CFLAGS $LDFLAGS -fprofile-generate -o $dir/eduterm-train $dir/eduterm.o \
+    $LDLIBS
+for f in $corpus/*; do
+    $dir/eduterm-train --replay $f > /dev/null 2>&1
+done
+
+$CC $CFLAGS -fprofile-use -flto -c -o $dir/eduterm.o eduterm.c
+$CC $CFLAGS $LDFLAGS -fprofile-use -flto -o eduterm $dir/eduterm.o $LDLIBS
+
+# best of $runs replays of file $2 by binary $1, in seconds
+best()
+{
+    for i in $(seq $runs); do
+        $1 --replay $2 2>&1 > /dev/null
+    done | awk '{ if (min == "" || $5 < min) min = $5 } END { print min }'
+}
+
+echo
+printf '%-10s %9s %9s %8s\n' stream plain pgo+lto speedup
+for f in $corpus/*; do
+    echo ${f##*/} $(best $dir/eduterm-plain $f) $(best ./eduterm $f)
+done | awk '{
+    printf "%-10s %8.3fs %8.3fs %7.2fx\n", $1, $2, $3, $2 / $3
+    plain += $2
+    pgo += $3
+} END {
+    printf "%-10s %8.3fs %8.3fs %7.2fx\n", "total", plain, pgo, plain / pgo
+}'
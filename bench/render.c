@@ -0,0 +1,195 @@
+/* Measures how fast x11_redraw() gets typical kinds of damage onto the
+ * screen:
+ *
+ *   churn    every cell changes color and glyph
+ *   row      one row of text changes
+ *   scroll   a new line at the bottom scrolls everything up
+ *   cursor   nothing changes but the cursor position
+ *   alt      switching between the main and the alternate screen
+ *
+ * Each frame, the damage is made by feeding escape sequences to the
+ * parser, the same way a program's output would. That part isn't timed.
+ * What is timed is x11_redraw() and the X server carrying it out: every
+ * frame ends with XSync().
+ *
+ * For every pattern and grid size, we report frames per second, cells
+ * painted per second and X requests sent per frame.
+ *
+ * eduterm.c is included as a whole, with its main() out of the way, so
+ * that we can call into it. Needs an X server to itself, see "make
+ * bench-render". */
+#define main eduterm_main
+#include "../eduterm.c"
+#undef main
+
+#define FRAMES 200
+
+static char frame_buf[1 << 20];
+
+typedef size_t (*pattern_fn)(struct X11 *x11, int frame, char *out);
+
+static size_t churn(struct X11 *x11, int frame, char *out)
+{
+    size_t n = sprintf(out, "\033[H");
+
+    for (int y = 0; y < x11->buf_h; y++) {
+        n += sprintf(out + n, "\033[%d;1H", y + 1);
+        for (int x = 0; x < x11->buf_w; x++) {
+            int c = frame + x + y;
+            n += sprintf(out + n, "\033[3%d;4%dm%c", c % 8, (c / 8) % 8,
+                         'A' + c % 26);
+        }
+    }
+
+    return n + sprintf(out + n, "\033[m");
+}
+
+static size_t row(struct X11 *x11, int frame, char *out)
+{
+    size_t n = sprintf(out, "\033[%d;1H", frame % x11->buf_h + 1);
+
+    for (int x = 0; x < x11->buf_w; x++)
+        out[n++] = 'a' + (frame + x) % 26;
+
+    return n;
+}
+
+static size_t scroll(struct X11 *x11, int frame, char *out)
+{
+    size_t n = sprintf(out, "\033[%d;1H\r\n", x11->buf_h);
+
+    for (int x = 0; x < x11->buf_w / 2; x++)
+        out[n++] = 'a' + (frame + x) % 26;
+
+    return n;
+}
+
+static size_t cursor(struct X11 *x11, int frame, char *out)
+{
+    return sprintf(out, "\033[%d;%dH", (frame * 7) % x11->buf_h + 1,
+                   (frame * 13) % x11->buf_w + 1);
+}
+
+static size_t alt(struct X11 *x11, int frame, char *out)
+{
+    (void)x11;
+    return sprintf(out, frame % 2 ? "\033[?1049l" : "\033[?1049hALT");
+}
+
+static const struct {
+    const char *name;
+    pattern_fn  fn;
+} patterns[] = {
+    {"churn", churn},
+    {"row", row},
+    {"scroll", scroll},
+    {"cursor", cursor},
+    {"alt", alt},
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct tab *bench_tab(int cols, int rows)
+{
+    struct tab *t = calloc(1, sizeof(*t));
+    XEvent      ev;
+
+    if (t == NULL)
+        return NULL;
+
+    term_cols = cols;
+    term_rows = rows;
+
+    t->x11 = x11_shared;
+    if (!term_setup(&t->x11))
+        return NULL;
+
+    t->pty.master = -1;  // nobody to answer to
+    x11_window(&t->x11);
+    t->x11.active = true;
+
+    // drawing into a window that isn't mapped yet is free
+    XWindowEvent(t->x11.dpy, t->x11.termwin, ExposureMask, &ev);
+    return t;
+}
+
+static void bench_tab_free(struct tab *t)
+{
+    XDestroyWindow(t->x11.dpy, t->x11.termwin);
+    XFreeGC(t->x11.dpy, t->x11.termgc);
+    term_free(&t->x11);
+    free(t);
+}
+
+static void bench(int cols, int rows)
+{
+    struct X11 *x = &x11_shared;
+
+    // the X server clips the rest, which would make it look cheap
+    if (cols * x->font_width > DisplayWidth(x->dpy, x->screen) ||
+        rows * x->font_height > DisplayHeight(x->dpy, x->screen)) {
+        fprintf(stderr, "%4dx%-4d doesn't fit on the screen, skipped\n",
+                cols, rows);
+        return;
+    }
+
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        struct tab *t = bench_tab(cols, rows);
+
+        if (t == NULL)
+            exit(1);
+
+        Display      *dpy      = t->x11.dpy;
+        double        elapsed  = 0;
+        size_t        cells    = 0;
+        unsigned long requests = 0;
+
+        x11_redraw(&t->x11);
+        XSync(dpy, False);
+
+        for (int f = 0; f < FRAMES; f++) {
+            size_t n = patterns[p].fn(&t->x11, f, frame_buf);
+            tab_feed(t, frame_buf, n);
+
+            double        t0 = now_s();
+            unsigned long r0 = NextRequest(dpy);
+
+            cells += x11_redraw(&t->x11);
+            requests += NextRequest(dpy) - r0;
+            XSync(dpy, False);
+
+            elapsed += now_s() - t0;
+        }
+
+        fprintf(stderr, "%4dx%-4d %-7s %9.1f frames/s %12.0f cells/s "
+                        "%9.1f requests/frame\n",
+                cols, rows, patterns[p].name, FRAMES / elapsed,
+                cells / elapsed, (double)requests / FRAMES);
+
+        bench_tab_free(t);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    // the parser is chatty, results go to stderr
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        return 1;
+
+    if (!x11_setup(&x11_shared))
+        return 1;
+
+    bench(80, 45);
+    bench(200, 60);
+    bench(400, 150);
+
+    return 0;
+}
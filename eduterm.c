@@ -1,23 +1,48 @@
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 #include <X11/Xlib.h>
+#include <X11/Xatom.h>
 #include <X11/Xutil.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stropts.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
+#include <wctype.h>
 #include <argp.h>
 
+#include "width.h"
+#ifdef USE_XCB
+#include <X11/Xlib-xcb.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+_Static_assert(sizeof(wchar_t) == 4, "SSE2 UTF-8 decoder assumes UTF-32");
+#endif
+
 /* Launching /bin/sh may launch a GNU Bash and that can have nasty side
  * effects. On my system, it clobbers ~/.bash_history because it doesn't
  * respect $HISTSIZE from my ~/.bashrc. That's very annoying. So, launch
@@ -34,6 +59,19 @@ struct RGB {
 
 bool exit_mode = false;
 bool print_child = false;
+bool daemon_mode = false;
+bool client_mode = false;
+char *exec_cmd = NULL;  // run this with /bin/sh -c instead of SHELL
+char *replay_file = NULL;  // feed this to a parser without X and quit
+char *triggers_file = NULL;  // see trigger_load()
+char *control_path = NULL;  // socket for scripts, see struct control
+char *open_cmd = "xdg-open \"$1\"";  // for links, see link_open()
+char *log_path = NULL;     // copy each tab's output there, see log_open()
+bool  log_text = false;    // without escape sequences
+off_t log_max  = 64 << 20; // bytes until the log is rotated, 0 never
+int  term_cols = 80;
+int  term_rows = 45;
+int  blink_idle = 30;  // seconds without activity until blinking stops
 
 static struct RGB col_os_vals[8 + 8] = {{0, 0, 0},         // black
                                         {205, 0, 0},       // red
@@ -67,6 +105,121 @@ struct cell {
     bool          bold;
     bool          italic;
     bool          dirty;
+    bool          wide;    // first half of a double width glyph
+    bool          wdummy;  // second half, never drawn on its own
+    unsigned short cluster; // combining marks, index into clusters[]
+};
+
+/* Combining marks (accents, variation selectors, the rest of a ZWJ emoji
+ * sequence) belong to the glyph in front of them. They are kept in a
+ * table on the side so that struct cell doesn't have to grow: a cell only
+ * carries an index, 0 meaning "no marks". Identical sequences share one
+ * entry. Entries are never freed, there just aren't that many different
+ * ones in practice. */
+#define CLUSTER_MAX  7
+#define CLUSTER_NONE 0
+
+struct cluster {
+    wchar_t       cp[CLUSTER_MAX];
+    unsigned char len;
+};
+
+static struct cluster *clusters;  // entry 0 is never used
+static size_t          clusters_len, clusters_cap;
+static unsigned short *cluster_hash;  // open addressing, 0 is a free slot
+static size_t          cluster_hash_cap;
+
+unsigned long cluster_hashval(const wchar_t *cp, size_t len)
+{
+    unsigned long h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned long)cp[i]) * 16777619u;
+    return h;
+}
+
+bool cluster_rehash(size_t cap)
+{
+    unsigned short *h = calloc(cap, sizeof(h[0]));
+    if (h == NULL)
+        return false;
+
+    for (size_t i = 1; i < clusters_len; i++) {
+        size_t j = cluster_hashval(clusters[i].cp, clusters[i].len) & (cap - 1);
+        while (h[j])
+            j = (j + 1) & (cap - 1);
+        h[j] = i;
+    }
+
+    free(cluster_hash);
+    cluster_hash     = h;
+    cluster_hash_cap = cap;
+    return true;
+}
+
+// returns the index of the sequence, CLUSTER_NONE if the table is full
+unsigned short cluster_intern(const wchar_t *cp, size_t len)
+{
+    if (clusters_len * 2 >= cluster_hash_cap) {
+        if (!cluster_rehash(cluster_hash_cap ? cluster_hash_cap * 2 : 256))
+            return CLUSTER_NONE;
+    }
+
+    size_t mask = cluster_hash_cap - 1;
+    size_t j    = cluster_hashval(cp, len) & mask;
+
+    for (; cluster_hash[j]; j = (j + 1) & mask) {
+        struct cluster *c = clusters + cluster_hash[j];
+        if (c->len == len && memcmp(c->cp, cp, len * sizeof(cp[0])) == 0)
+            return cluster_hash[j];
+    }
+
+    if (clusters_len == 0)
+        clusters_len = 1;
+    if (clusters_len > 0xFFFF)
+        return CLUSTER_NONE;
+
+    if (clusters_len >= clusters_cap) {
+        size_t          cap = clusters_cap ? clusters_cap * 2 : 64;
+        struct cluster *n   = realloc(clusters, cap * sizeof(clusters[0]));
+        if (n == NULL)
+            return CLUSTER_NONE;
+        clusters     = n;
+        clusters_cap = cap;
+    }
+
+    memcpy(clusters[clusters_len].cp, cp, len * sizeof(cp[0]));
+    clusters[clusters_len].len = len;
+    cluster_hash[j]            = clusters_len;
+
+    return clusters_len++;
+}
+
+/* A row of the screen. Rows are reference counted and copied before
+ * they are written to (see row_mut()). All blank rows are the very same
+ * instance, x11->blank_row, which has the blank flag set and is never
+ * written to; such rows are not looked at cell by cell, neither when
+ * erasing nor when drawing. It's counted like any other row, as a
+ * selection may still hold on to it once the screen is gone. */
+struct row {
+    int         refs;
+    bool        blank;
+    struct cell cells[];
+};
+
+/* A URL ("scheme://...") or a file name with a line number ("path:line"
+ * or "path:line:column") on the screen, see link_scan(). */
+struct link {
+    int x0, x1;  // first and last cell
+    int colon;   // the cell of the colon before the line, -1 for a URL
+};
+
+#define ROW_LINKS 8  // links per row we keep track of, the rest is ignored
+
+// what link_scan() found on one row of the screen
+struct row_links {
+    bool        stale;  // something new was drawn there since
+    int         n;
+    struct link at[ROW_LINKS];
 };
 
 bool equals(struct cell* a, struct cell* b)
@@ -85,6 +238,10 @@ bool equals(struct cell* a, struct cell* b)
         return false;
     if (a->italic != b->italic)
         return false;
+    if (a->wide != b->wide || a->wdummy != b->wdummy)
+        return false;
+    if (a->cluster != b->cluster)
+        return false;
     
     return true;
 }
@@ -113,8 +270,15 @@ struct X11 {
     int      screen;
     Window   root;
 
+    /* Tabs share the display connection, the window, the fonts and the
+     * colors: these are copied from the first tab, see tab_open(). Only
+     * the active tab draws into the window. */
     Window        termwin;
     GC            termgc;
+    Atom          net_wm_name, utf8_string;
+    Atom          wm_protocols, wm_delete_window;
+    Atom          clipboard, targets, incr, text, paste_prop;
+    bool          active;
     unsigned long col_fg, col_bg, col_bk;
     int           w, h;
 
@@ -123,12 +287,26 @@ struct X11 {
     XFontSet     xitalicfontset;
     int          font_width, font_height, font_yadg;
 
-    struct cell *buf_alt;
-    struct cell *buf;
+    /* The screen is kept as an array of row pointers, so that inserting,
+     * deleting and scrolling lines only has to shuffle pointers. */
+    struct row  **rows_alt;  // NULL until the alternate screen is used
+    struct row  **rows;
+    bool          alt_active;
+    struct cell   blank;      // what erased cells look like
+    struct row   *blank_row;  // a row full of them, shared by everyone
+    bool         *line_dirty; // redraw line y as a whole, cells or not
     int          buf_w, buf_h;
     int          buf_x, buf_y;
     int          buf_alt_x, buf_alt_y;
     bool         blink, cur;
+    bool         blink_mode;       // DEC private mode 12
+    bool         focused, visible;
+    time_t       last_activity;
+
+    /* Synchronized output (DEC private mode 2026): the application is in
+     * the middle of drawing a frame, don't show it half done. */
+    bool         sync_update;
+    long         sync_since;  // ms, see monotonic_ms()
 
     int scr_begin, scr_end;
 
@@ -142,19 +320,127 @@ struct X11 {
     unsigned long col_256[256 /* duh */];
 
     bool application_keypad;
+
+    /* Mouse tracking: which events the application wants (DEC private
+     * mode 1000, 1002 or 1003, 0 for none), in which encoding, and the
+     * cell the pointer was last reported in. */
+    int  mouse_mode;
+    bool mouse_sgr;  // 1006
+    int  mouse_x, mouse_y;
+
+    bool bracketed_paste;  // DEC private mode 2004
+
+    /* The selection: it goes from the cell the button went down on
+     * (sel_ax, sel_ay) to the one the pointer is on (sel_bx, sel_by).
+     * sel_update() works out the cells in between, from (sel_x0, sel_y0)
+     * to (sel_x1, sel_y1), and holds on to their rows, see sel_check(). */
+    int          sel_mode;   // SEL_NONE, ...
+    bool         sel_block;  // a rectangle instead of running text
+    bool         sel_drag;   // the button is still down
+    int          sel_ax, sel_ay, sel_bx, sel_by;
+    int          sel_x0, sel_y0, sel_x1, sel_y1;
+    struct row **sel_rows;   // NULL if nothing is selected
+    Time         sel_time;   // of the last click, for double clicks
+    int          sel_clicks;
+
+    /* Links, by row. A row is only looked at again once x11_redraw() has
+     * painted something new on it, and only once the pointer is on it,
+     * see links_row(). The link under the pointer is underlined. */
+    struct row_links *links;
+    int               pointer_x, pointer_y;  // -1 outside the window
+    int               hover_y;               // -1 for no link there
+    struct link       hover;
+};
+
+enum {
+    SEL_NONE,
+    SEL_CHAR,
+    SEL_WORD,
+    SEL_LINE,
 };
 
+/* Erased cells take the current background color, like xterm's (BCE,
+ * "background color erase"), not the default one. Only with the
+ * default one do they look like x11->blank, and whole rows can be the
+ * shared blank row. */
+bool erase_blank(const struct X11 *x11)
+{
+    return x11->sgr_bg_col == x11->blank.bg;
+}
+
 void clear(struct X11 *x11, struct cell *c)
 {
-    struct cell backup = *c;
+    struct cell e = x11->blank;
+
+    e.bg = x11->sgr_bg_col;
+
+    bool dirty = c->dirty || !equals(c, &e);
+
+    *c       = e;
+    c->dirty = dirty;
+}
+
+struct row *row_ref(struct row *r)
+{
+    r->refs++;
+    return r;
+}
+
+void row_release(struct row *r)
+{
+    if (--r->refs == 0)
+        free(r);
+}
+
+/* Returns row y ready to be written to. If it is shared with someone
+ * else (the blank row, or a selection, see sel_update()), it gets a copy
+ * of its own first. */
+struct row *row_mut(struct X11 *x11, int y)
+{
+    struct row *r = x11->rows[y];
+
+    if (r->refs == 1)
+        return r;
+
+    size_t      size = sizeof(struct row) + x11->buf_w * sizeof(struct cell);
+    struct row *n    = malloc(size);
+    if (n == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    memcpy(n, r, size);
+    n->refs  = 1;
+    n->blank = false;
+
+    row_release(r);
+    x11->rows[y] = n;
+    return n;
+}
+
+/* Blanks row y by pointing it at the shared blank row. No cell is
+ * touched or compared, the line will be drawn as a single rectangle.
+ * In another background color than the default, the row has to be
+ * filled in cell by cell, see erase_blank(). */
+void erase_row(struct X11 *x11, int y)
+{
+    if (!erase_blank(x11)) {
+        struct row *r = row_mut(x11, y);
+        struct cell e = x11->blank;
+
+        e.bg = x11->sgr_bg_col;
+        for (int x = 0; x < x11->buf_w; x++)
+            r->cells[x] = e;
+        x11->line_dirty[y] = true;
+        return;
+    }
 
-    c->g     = L' ';
-    c->fg    = x11->col_fg;
-    c->bg    = x11->col_bg;
-    c->bold  = false;
-    c->italic = false;
+    if (x11->rows[y]->blank)
+        return;
 
-    c->dirty |= !equals(&backup, c);
+    row_release(x11->rows[y]);
+    x11->rows[y]       = row_ref(x11->blank_row);
+    x11->line_dirty[y] = true;
 }
 
 void dirty(struct cell *c)
@@ -165,25 +451,128 @@ void dirty(struct cell *c)
 // does not handle moving cursor or wrapping
 void putch(struct X11 *x11, wchar_t g)
 {
-    struct cell *c = x11->buf + x11->buf_y * x11->buf_w + x11->buf_x;
+    struct cell *c = row_mut(x11, x11->buf_y)->cells + x11->buf_x;
 
     c->g     = g;
     c->fg    = x11->sgr_fg_col;
     c->bg    = x11->sgr_bg_col;
     c->bold  = x11->sgr_bold;
     c->italic  = x11->sgr_italic;
+    c->wide    = false;
+    c->wdummy  = false;
+    c->cluster = CLUSTER_NONE;
     c->dirty = true;
 }
 
+// attaches a zero width code point to the glyph in c
+void cluster_append(struct cell *c, wchar_t cp)
+{
+    wchar_t seq[CLUSTER_MAX];
+    size_t  len = 0;
+
+    if (c->cluster != CLUSTER_NONE) {
+        len = clusters[c->cluster].len;
+        memcpy(seq, clusters[c->cluster].cp, len * sizeof(seq[0]));
+    }
+
+    // overly long sequences lose their tail
+    if (len == CLUSTER_MAX)
+        return;
+
+    seq[len++] = cp;
+
+    unsigned short idx = cluster_intern(seq, len);
+    if (idx != CLUSTER_NONE) {
+        c->cluster = idx;
+        c->dirty   = true;
+    }
+}
+
+// true if the glyph in c ends with a zero width joiner
+bool cluster_joins(const struct cell *c)
+{
+    if (c->cluster == CLUSTER_NONE)
+        return false;
+
+    const struct cluster *cl = clusters + c->cluster;
+    return cl->cp[cl->len - 1] == 0x200D;
+}
+
+// the base glyph and its marks, out needs room for 1 + CLUSTER_MAX
+int cell_text(const struct cell *c, wchar_t *out)
+{
+    out[0] = c->g;
+    if (c->cluster == CLUSTER_NONE)
+        return 1;
+
+    const struct cluster *cl = clusters + c->cluster;
+    memcpy(out + 1, cl->cp, cl->len * sizeof(out[0]));
+    return 1 + cl->len;
+}
+
+/* Number of cells a code point takes up, looked up in the table that
+ * mkwidth.py generates. No wcwidth(), so the result doesn't depend on
+ * the locale either. */
+int glyph_width(wchar_t g)
+{
+    if ((unsigned long)g >= 0x110000)
+        return 1;
+
+    unsigned int  blk  = width_stage1[g >> WIDTH_BLOCK_SHIFT];
+    unsigned int  i    = g & ((1 << WIDTH_BLOCK_SHIFT) - 1);
+    unsigned char bits = width_stage2[blk][i >> 2];
+
+    return (bits >> ((i & 3) * 2)) & 3;
+}
+
+/* Breaks up a double width glyph that straddles the boundary left of
+ * column x, i.e. one that is about to lose one of its halves. Both
+ * halves are blanked. */
+void split_wide(struct X11 *x11, int y, int x)
+{
+    struct cell *row = x11->rows[y]->cells;
+
+    if (x > 0 && x <= x11->buf_w && row[x - 1].wide) {
+        row = row_mut(x11, y)->cells;
+        clear(x11, row + x - 1);
+        if (x < x11->buf_w)
+            clear(x11, row + x);
+    }
+    else if (x < x11->buf_w && row[x].wdummy) {
+        row = row_mut(x11, y)->cells;
+        clear(x11, row + x);
+    }
+}
+
 void clear_cells(struct X11* x11, struct cell* begin, struct cell* end)
 {
     for (; begin != end; ++begin)
         clear(x11, begin);
 }
 
+/* Erases columns begin to end (exclusive) of row y. Ranges that cover
+ * the whole row go through erase_row(). */
+void erase_cells(struct X11 *x11, int y, int begin, int end)
+{
+    if (begin <= 0 && end >= x11->buf_w) {
+        erase_row(x11, y);
+    }
+    else if ((!x11->rows[y]->blank || !erase_blank(x11)) && begin < end) {
+        struct row *r = row_mut(x11, y);
+        clear_cells(x11, r->cells + begin, r->cells + end);
+    }
+}
+
+// erases rows top to bottom (inclusive)
+void erase_rows(struct X11 *x11, int top, int bottom)
+{
+    for (int y = top; y <= bottom; y++)
+        erase_row(x11, y);
+}
+
 void clear_all_cells(struct X11 *x11)
 {
-    clear_cells(x11, x11->buf, x11->buf + x11->buf_w * x11->buf_h);
+    erase_rows(x11, 0, x11->buf_h - 1);
 }
 
 void dirty_cells(struct cell* begin, struct cell* end)
@@ -192,17 +581,79 @@ void dirty_cells(struct cell* begin, struct cell* end)
         dirty(begin);
 }
 
+// marks rows top to bottom (inclusive) for redrawing
+void dirty_rows(struct X11 *x11, int top, int bottom)
+{
+    for (int y = top; y <= bottom; y++)
+        x11->line_dirty[y] = true;
+}
+
 void dirty_all_cells(struct X11 *x11)
 {
-    dirty_cells(x11->buf, x11->buf + x11->buf_w * x11->buf_h);
+    dirty_rows(x11, 0, x11->buf_h - 1);
+}
+
+/* Moves rows top to bottom (inclusive) n rows up. The rows that fall off
+ * at the top are cleared and come back in at the bottom. Everything in
+ * between has changed its place on screen, so it is all dirty. */
+void rows_up(struct X11 *x11, int top, int bottom, int n)
+{
+    int span = bottom - top + 1;
+
+    if (span <= 0 || n <= 0)
+        return;
+    if (n > span)
+        n = span;
+
+    struct row *tmp[n];
+    memcpy(tmp, x11->rows + top, n * sizeof(tmp[0]));
+    memmove(x11->rows + top, x11->rows + top + n, (span - n) * sizeof(tmp[0]));
+    memcpy(x11->rows + bottom - n + 1, tmp, n * sizeof(tmp[0]));
+
+    erase_rows(x11, bottom - n + 1, bottom);
+
+    dirty_rows(x11, top, bottom);
+}
+
+// the opposite of rows_up(), blank rows come in at the top
+void rows_down(struct X11 *x11, int top, int bottom, int n)
+{
+    int span = bottom - top + 1;
+
+    if (span <= 0 || n <= 0)
+        return;
+    if (n > span)
+        n = span;
+
+    struct row *tmp[n];
+    memcpy(tmp, x11->rows + bottom - n + 1, n * sizeof(tmp[0]));
+    memmove(x11->rows + top + n, x11->rows + top, (span - n) * sizeof(tmp[0]));
+    memcpy(x11->rows + top, tmp, n * sizeof(tmp[0]));
+
+    erase_rows(x11, top, top + n - 1);
+
+    dirty_rows(x11, top, bottom);
+}
+
+// a screen full of blank rows, which costs nothing but the pointers
+struct row **alloc_rows(struct X11 *x11)
+{
+    struct row **rows = calloc(x11->buf_h, sizeof(rows[0]));
+    if (rows == NULL)
+        return NULL;
+
+    for (int y = 0; y < x11->buf_h; y++)
+        rows[y] = row_ref(x11->blank_row);
+
+    return rows;
 }
 
 void switch_buffers(struct X11* x11) 
 {
-    struct cell *tmp = x11->buf;
+    struct row **tmp = x11->rows;
 
-    x11->buf     = x11->buf_alt;
-    x11->buf_alt = tmp;
+    x11->rows     = x11->rows_alt;
+    x11->rows_alt = tmp;
 
     int tmpc;
     tmpc           = x11->buf_x;
@@ -262,6 +713,11 @@ bool pt_pair(struct PTY *pty)
 
     fcntl(pty->master, F_SETFL, fcntl(pty->master, F_GETFL) | O_NONBLOCK);
 
+    /* Not for the shells of other tabs, or for what triggers and links
+     * run: as long as one of them held on to it, closing it here would
+     * no longer hang up this tab's shell. */
+    fcntl(pty->master, F_SETFD, FD_CLOEXEC);
+
     /* grantpt() and unlockpt() are housekeeping functions that have to
      * be called before we can open the slave FD. Refer to the manpages
      * on what they do. */
@@ -334,70 +790,220 @@ char IsKeypad(KeySym keysym)
     };
 }
 
-wchar_t utf8_to_utf32(char *buf, size_t size)
+/* UTF-8 decoding state that survives between two read()s, so a
+ * sequence may be split across them. lo and hi are the valid range for
+ * the next continuation byte, which is how overlong forms, surrogates
+ * and code points above U+10FFFF are rejected. */
+struct utf8 {
+    wchar_t       cp;
+    int           need;
+    unsigned char lo, hi;
+};
+
+#define UTF8_REPLACEMENT ((wchar_t)0xFFFD)
+
+bool is_text_byte(unsigned char b)
 {
-    if (size == 1)
-        return (buf[0] & 0x7F);
-    else if (size == 2)
-        return (buf[0] & 0x1F) << 6 | (buf[1] & 0x3F);
-    else if (size == 3) {
-        return (buf[0] & 0x0F) << 12 | (buf[1] & 0x3F) << 6 | (buf[2] & 0x3F);
-    }
-    else if (size == 4)
-        return (buf[0] & 0x07) << 18 | (buf[1] & 0x3F) << 12 |
-               (buf[2] & 0x3F) << 6 | (buf[3] & 0x3F);
-    else
-        eexit(1);
-    return L' ';
+    return b >= 0x20 && b != 0x7f;
+}
+
+// returns true and stores U+FFFD if an incomplete sequence was pending
+bool utf8_flush(struct utf8 *st, wchar_t *out)
+{
+    if (st->need == 0)
+        return false;
+
+    st->need = 0;
+    *out     = UTF8_REPLACEMENT;
+    return true;
 }
 
-void print_utf32(wchar_t ch)
+// feeds one byte, returns the number of code points stored in out (0-2)
+size_t utf8_feed(struct utf8 *st, unsigned char b, wchar_t *out)
 {
-    char   buf[5];  // 4 utf8 bytes plus \0
-    size_t len;     // length minus \0
+    size_t n = 0;
+
+    if (st->need > 0) {
+        if (b >= st->lo && b <= st->hi) {
+            st->cp = st->cp << 6 | (b & 0x3F);
+            st->lo = 0x80;
+            st->hi = 0xBF;
+            if (--st->need == 0)
+                out[n++] = st->cp;
+            return n;
+        }
 
-    char *target = buf;
+        // truncated sequence, b starts something new
+        out[n++] = UTF8_REPLACEMENT;
+        st->need = 0;
+    }
 
-    static const wchar_t byteMask         = 0xBF;
-    static const wchar_t byteMark         = 0x80;
-    static const char    firstByteMark[7] = {
-        0x00, 0x00, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC};
+    st->lo = 0x80;
+    st->hi = 0xBF;
 
-    if (ch < (wchar_t)0x80) {
-        len = 1;
+    if (b < 0x80) {
+        out[n++] = b;
+    }
+    else if (b >= 0xC2 && b <= 0xDF) {
+        st->cp   = b & 0x1F;
+        st->need = 1;
     }
-    else if (ch < (wchar_t)0x800) {
-        len = 2;
+    else if (b >= 0xE0 && b <= 0xEF) {
+        st->cp   = b & 0x0F;
+        st->need = 2;
+        if (b == 0xE0)
+            st->lo = 0xA0;
+        else if (b == 0xED)
+            st->hi = 0x9F;
     }
-    else if (ch < (wchar_t)0x10000) {
-        len = 3;
+    else if (b >= 0xF0 && b <= 0xF4) {
+        st->cp   = b & 0x07;
+        st->need = 3;
+        if (b == 0xF0)
+            st->lo = 0x90;
+        else if (b == 0xF4)
+            st->hi = 0x8F;
     }
     else {
-        len = 4;
+        // stray continuation byte, 0xC0, 0xC1 or 0xF5 and above
+        out[n++] = UTF8_REPLACEMENT;
+    }
+
+    return n;
+}
+
+/* Decodes the run of text at the start of src (up to the first C0
+ * control or DEL) into out, which must have room for n + 1 code points.
+ * Returns the number of bytes consumed; *nout is set to the number of
+ * code points written.
+ *
+ * Blocks of 16 printable ASCII bytes are checked and widened to UTF-32
+ * with SSE2. Everything else goes through utf8_feed(). */
+size_t utf8_decode(struct utf8 *st, const char *src, size_t n, wchar_t *out,
+                   size_t *nout)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    size_t               i = 0, o = 0;
+
+    while (i < n) {
+#ifdef __SSE2__
+        if (st->need == 0 && s[i] < 0x80 && n - i >= 16) {
+            __m128i v   = _mm_loadu_si128((const __m128i *)(s + i));
+            __m128i ok  = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)),
+                                        _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F)));
+            int     msk = _mm_movemask_epi8(ok);
+
+            if (msk == 0xFFFF) {
+                __m128i z  = _mm_setzero_si128();
+                __m128i lo = _mm_unpacklo_epi8(v, z);
+                __m128i hi = _mm_unpackhi_epi8(v, z);
+                __m128i *d = (__m128i *)(out + o);
+                _mm_storeu_si128(d + 0, _mm_unpacklo_epi16(lo, z));
+                _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(lo, z));
+                _mm_storeu_si128(d + 2, _mm_unpacklo_epi16(hi, z));
+                _mm_storeu_si128(d + 3, _mm_unpackhi_epi16(hi, z));
+                i += 16;
+                o += 16;
+                continue;
+            }
+
+            // copy the printable ASCII prefix, then fall through
+            int k = __builtin_ctz(~msk);
+            for (int j = 0; j < k; j++)
+                out[o++] = s[i++];
+            if (k > 0)
+                continue;
+        }
+#endif
+        if (!is_text_byte(s[i]))
+            break;
+
+        o += utf8_feed(st, s[i], out + o);
+        i++;
+    }
+
+    *nout = o;
+    return i;
+}
+
+// the other way round, out needs room for 4 bytes
+size_t utf8_encode(wchar_t cp, char *out)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xc0 | cp >> 6;
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xe0 | cp >> 12;
+        out[1] = 0x80 | (cp >> 6 & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | cp >> 18;
+    out[1] = 0x80 | (cp >> 12 & 0x3f);
+    out[2] = 0x80 | (cp >> 6 & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/* Encodes n code points as UTF-8, out needs room for 4 * n bytes.
+ * Returns the number of bytes written.
+ *
+ * Text on a terminal is mostly ASCII. Blocks of 8 code points that are
+ * all ASCII are narrowed to bytes with SSE2, everything else goes
+ * through utf8_encode(). */
+size_t utf32_to_utf8(const wchar_t *in, size_t n, char *out)
+{
+    size_t i = 0, o = 0;
+
+    while (i < n) {
+#ifdef __SSE2__
+        if (n - i >= 8) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(in + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(in + i + 4));
+            __m128i m = _mm_set1_epi32(0x7F);
+
+            if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi32(a, m),
+                                               _mm_cmpgt_epi32(b, m))) == 0) {
+                __m128i w = _mm_packs_epi32(a, b);
+                _mm_storel_epi64((__m128i *)(out + o),
+                                 _mm_packus_epi16(w, w));
+                i += 8;
+                o += 8;
+                continue;
+            }
+        }
+#endif
+        o += utf8_encode(in[i++], out + o);
     }
 
-    target += len;
+    return o;
+}
+
+/* The text of cells x0 to x1 (inclusive) of row r, combining marks and
+ * all, without the blanks at the end. out needs room for
+ * (x1 - x0 + 1) * (1 + CLUSTER_MAX) code points. Returns how many it
+ * got. */
+size_t row_glyphs(const struct row *r, int x0, int x1, wchar_t *out)
+{
+    size_t n = 0;
 
-    switch (len) { /* note: everything falls through. */
-      case 4: 
-        *--target = (char)((ch | byteMark) & byteMask);
-        ch >>= 6;
-        __attribute__((fallthrough));
-      case 3:
-        *--target = (char)((ch | byteMark) & byteMask);
-        ch >>= 6;
-        __attribute__((fallthrough));
-      case 2:
-        *--target = (char)((ch | byteMark) & byteMask);
-        ch >>= 6;
-        __attribute__((fallthrough));
-      case 1:
-        *--target = (char)(ch | firstByteMark[len]);
+    for (int x = x0; x <= x1; x++) {
+        // the second half of a glyph, or half a glyph cut off on the left
+        if (r->cells[x].wdummy)
+            continue;
+        n += cell_text(r->cells + x, out + n);
     }
 
-    buf[len] = '\0';
+    while (n > 0 && out[n - 1] == L' ')
+        n--;
 
-    printf("%s", buf);
+    return n;
 }
 
 void swap(unsigned long* a, unsigned long* b)
@@ -407,164 +1013,506 @@ void swap(unsigned long* a, unsigned long* b)
     *b = tmp;
 }
 
-void x11_redraw(struct X11 *x11)
-{
-    if (!x11->cur)
-        return;
+// what a double click selects, besides letters and digits
+#define WORD_DELIMS L" \t\"'`()[]{}<>|;,"
 
-    size_t total = 0;
-    int     x, y;
+bool word_char(const struct cell *c)
+{
+    return c->wdummy || wcschr(WORD_DELIMS, c->g) == NULL;
+}
 
-    for (y = 0; y < x11->buf_h; y++) {
-        for (x = 0; x < x11->buf_w; x++) {
-            struct cell *c = x11->buf + (y * x11->buf_w + x);
+// lets go of the selection, if there is one
+void sel_clear(struct X11 *x11)
+{
+    if (x11->sel_rows != NULL) {
+        for (int y = x11->sel_y0; y <= x11->sel_y1; y++)
+            row_release(x11->sel_rows[y - x11->sel_y0]);
+        free(x11->sel_rows);
+        x11->sel_rows = NULL;
+        dirty_rows(x11, x11->sel_y0, x11->sel_y1);
+    }
 
-            bool is_cursor = x == x11->buf_x && y == x11->buf_y;
+    x11->sel_mode = SEL_NONE;
+    x11->sel_drag = false;
+}
 
-            if (!is_cursor && !c->dirty)
-                continue;
+/* Works out which cells are selected, after the pointer has moved to
+ * (sel_bx, sel_by), and takes a reference to their rows.
+ *
+ * Those references are what keeps the selection in step with the
+ * screen: a row that is written to while someone else holds on to it
+ * gets copied (see row_mut()), and a row that scrolls moves away. Either
+ * way, it's not the one we have anymore, see sel_check(). */
+void sel_update(struct X11 *x11)
+{
+    int ax = x11->sel_ax, ay = x11->sel_ay;
+    int bx = x11->sel_bx, by = x11->sel_by;
+    int x0, y0, x1, y1;
+
+    if (x11->sel_block) {
+        x0 = ax < bx ? ax : bx;
+        x1 = ax < bx ? bx : ax;
+        y0 = ay < by ? ay : by;
+        y1 = ay < by ? by : ay;
+    }
+    else if (ay < by || (ay == by && ax <= bx)) {
+        x0 = ax, y0 = ay, x1 = bx, y1 = by;
+    }
+    else {
+        x0 = bx, y0 = by, x1 = ax, y1 = ay;
+    }
 
-            total++;
-            wchar_t       g  = c->g;
-            unsigned long bg = c->bg;
-            unsigned long fg = c->fg;
-            bool          bold = c->bold;
-            bool          italic = c->italic;
-
-            if (is_cursor && x11->blink) swap(&fg, &bg);
-
-            XSetForeground(x11->dpy, x11->termgc, bg);
-
-            XFillRectangle(x11->dpy,
-                           x11->termwin,
-                           x11->termgc,
-                           x * x11->font_width,
-                           y * x11->font_height,
-                           x11->font_width,
-                           x11->font_height);
-
-            XSetForeground(x11->dpy, x11->termgc, fg);
-
-            if (bold) {
-                XwcDrawString(x11->dpy,
-                              x11->termwin,
-                              x11->xboldfontset,
-                              x11->termgc,
-                              x * x11->font_width,
-                              y * x11->font_height + x11->font_yadg,
-                              &g,
-                              1);
-            } else if (italic) {
-                XwcDrawString(x11->dpy,
-                              x11->termwin,
-                              x11->xitalicfontset,
-                              x11->termgc,
-                              x * x11->font_width,
-                              y * x11->font_height + x11->font_yadg,
-                              &g,
-                              1);
-            } else {
-                XwcDrawString(x11->dpy,
-                              x11->termwin,
-                              x11->xfontset,
-                              x11->termgc,
-                              x * x11->font_width,
-                              y * x11->font_height + x11->font_yadg,
-                              &g,
-                              1);
-            }
+    if (x11->sel_mode == SEL_WORD && !x11->sel_block) {
+        const struct cell *r0 = x11->rows[y0]->cells;
+        const struct cell *r1 = x11->rows[y1]->cells;
 
-            if (x == x11->buf_x && y == x11->buf_y)
-                c->dirty = true;
-            else c->dirty = false;
-        }
+        while (x0 > 0 && word_char(r0 + x0) && word_char(r0 + x0 - 1))
+            x0--;
+        while (x1 < x11->buf_w - 1 && word_char(r1 + x1) &&
+               word_char(r1 + x1 + 1))
+            x1++;
+    }
+    else if (x11->sel_mode == SEL_LINE) {
+        x0 = 0;
+        x1 = x11->buf_w - 1;
     }
 
-    if (x11->blink) {
-        XSetForeground(x11->dpy, x11->termgc, x11->col_fg);
+    // both halves of a wide glyph or neither
+    if (x0 > 0 && x11->rows[y0]->cells[x0].wdummy)
+        x0--;
+    if (x1 < x11->buf_w - 1 && x11->rows[y1]->cells[x1].wide)
+        x1++;
+
+    int mode = x11->sel_mode;
+    bool drag = x11->sel_drag;
+    sel_clear(x11);
+    x11->sel_mode = mode;
+    x11->sel_drag = drag;
+
+    x11->sel_rows = malloc((y1 - y0 + 1) * sizeof(x11->sel_rows[0]));
+    if (x11->sel_rows == NULL) {
+        perror("malloc");
+        return;
     }
-    else {
-        XSetForeground(x11->dpy, x11->termgc, x11->col_bk);
+
+    for (int y = y0; y <= y1; y++)
+        x11->sel_rows[y - y0] = row_ref(x11->rows[y]);
+
+    x11->sel_x0 = x0;
+    x11->sel_y0 = y0;
+    x11->sel_x1 = x1;
+    x11->sel_y1 = y1;
+    dirty_rows(x11, y0, y1);
+}
+
+/* What was selected has changed, or moved: the selection goes. Compares
+ * row pointers, so it's cheap enough to do before each redraw. */
+void sel_check(struct X11 *x11)
+{
+    for (int y = x11->sel_y0; y <= x11->sel_y1; y++) {
+        if (x11->rows[y] != x11->sel_rows[y - x11->sel_y0]) {
+            sel_clear(x11);
+            return;
+        }
     }
+}
 
-    XFlush(x11->dpy);
+bool sel_on_row(const struct X11 *x11, int y)
+{
+    return x11->sel_rows != NULL && y >= x11->sel_y0 && y <= x11->sel_y1;
+}
+
+bool sel_has(const struct X11 *x11, int x, int y)
+{
+    if (!sel_on_row(x11, y))
+        return false;
+
+    if (x11->sel_block)
+        return x >= x11->sel_x0 && x <= x11->sel_x1;
 
-    // printf("Total cells drawn %d\n", (int)total);
+    return (y > x11->sel_y0 || x >= x11->sel_x0) &&
+           (y < x11->sel_y1 || x <= x11->sel_x1);
 }
 
-char ascii_char(const struct cell* c)
+// the character in cell c if it's printable ASCII, else 0
+int link_char(const struct cell *c)
 {
-    if (iswspace(c->g))
-        return ' ';
-    else if (iswcntrl(c->g))
-        return ' ';
-    else if (iswcntrl(c->g))
-        return ' ';
-    else if (iswprint(c->g))
-        return c->g;
-    else
-        return '?';
+    if (c->wdummy || c->cluster != CLUSTER_NONE || c->g <= ' ' || c->g > '~')
+        return 0;
+    return c->g;
 }
 
-char bold_char(const struct cell* c)
+// what file names (and the scheme of a URL) are made of
+bool path_char(int ch)
 {
-    if (c->bold)
-        return '!';
-    else
-        return ' ';
+    return isalnum(ch) || (ch != 0 && strchr("_./~+-", ch) != NULL);
 }
-char italic_char(const struct cell* c)
+
+bool url_char(int ch)
 {
-    if (c->italic)
-        return '!';
-    else
-        return ' ';
+    return ch != 0 && strchr("<>\"{}|\\^`", ch) == NULL;
 }
 
-void print_screen(struct X11* x11, char(*cell_val)(const struct cell *c))
+/* Finds the links on row r, w cells wide, ROW_LINKS at most. ASCII only,
+ * and a link doesn't go on to the next row. A URL loses the punctuation
+ * at its end ("see https://example.com."), but keeps a parenthesis that
+ * has its opening one inside. A file name needs a letter and a dot or a
+ * slash in it, so that neither "error:12" nor "127.0.0.1:80" is one. */
+int link_scan(const struct row *r, int w, struct link *out)
 {
-    printf("\n");
-    char row[x11->buf_w + 1];
-    row[x11->buf_w] = '\0';
+    const struct cell *c = r->cells;
+    int                n = 0, x = 0;
 
-    for (int x = 0; x < x11->buf_w; x++)
-        row[x] = '_';
+    while (x < w && n < ROW_LINKS) {
+        if (!path_char(link_char(c + x))) {
+            x++;
+            continue;
+        }
+
+        int  start = x, end = x;
+        bool alpha = false, dot = false;
+
+        for (; end < w && path_char(link_char(c + end)); end++) {
+            alpha |= isalpha(c[end].g);
+            dot   |= c[end].g == '.' || c[end].g == '/';
+        }
 
-    printf(" . %s . \n", row);
+        if (end + 3 < w && c[end].g == ':' && c[end + 1].g == '/' &&
+            c[end + 2].g == '/') {
+            int s = end, e = end + 3, parens = 0;
 
-    for(int y=0;y<x11->buf_h; y++){
-        for (int x = 0; x < x11->buf_w; x++) {
-            const struct cell *c = x11->buf + (x11->buf_w * y + x);
+            // the scheme: a letter, then letters, digits, '+', '-', '.'
+            while (s > start && (isalnum(c[s - 1].g) ||
+                                 strchr("+-.", c[s - 1].g) != NULL))
+                s--;
+            while (s < end && !isalpha(c[s].g))
+                s++;
+
+            for (; e < w && url_char(link_char(c + e)); e++)
+                parens += (c[e].g == '(') - (c[e].g == ')');
+
+            while (e > end + 3) {
+                if (c[e - 1].g == ')' && parens < 0)
+                    parens++;
+                else if (strchr(".,:;!?'", c[e - 1].g) == NULL)
+                    break;
+                e--;
+            }
 
-            row[x] = cell_val(c);
+            if (s < end && e > end + 3) {
+                out[n++] = (struct link){s, e - 1, -1};
+                x        = e;
+                continue;
+            }
         }
-        printf(" | %s | \n", row);
-    }
 
-    for (int x = 0; x < x11->buf_w; x++)
-        row[x] = '-';
+        if (alpha && dot && end + 1 < w && c[end].g == ':' &&
+            isdigit(link_char(c + end + 1))) {
+            int e = end + 1;
+
+            while (e < w && isdigit(link_char(c + e)))
+                e++;
+            if (e + 1 < w && c[e].g == ':' && isdigit(link_char(c + e + 1)))
+                for (e++; e < w && isdigit(link_char(c + e)); e++)
+                    ;
+
+            out[n++] = (struct link){start, e - 1, end};
+            x        = e;
+            continue;
+        }
 
-    printf(" ` %s ` \n", row);
+        x = end;
+    }
 
-    printf("\n");
+    return n;
 }
 
-void x11_key(XKeyEvent *ev, struct PTY *pty, struct X11* x11)
+// the whole screen is to be looked at again for links
+void links_stale(struct X11 *x11)
 {
-    char   buf[32];
-    int    num;
-    KeySym ksym;
+    for (int y = 0; y < x11->buf_h; y++)
+        x11->links[y].stale = true;
+}
 
-    num      = XLookupString(ev, buf, sizeof(buf) - 1, &ksym, 0);
-    buf[num] = 0;
+// the links on row y, looked for again if anything new was drawn there
+struct row_links *links_row(struct X11 *x11, int y)
+{
+    struct row_links *l = x11->links + y;
+    struct row       *r = x11->rows[y];
 
-    if (IsTtyFunctionOrSpaceKey(ksym)) {
-        printf("XKeyEvent non character = (%x) len() == %d\n", 0xFF & buf[0], num);
-        if(ksym == XK_BackSpace){
-            printf("XBackspace \n");
-            // backspace
-            num = snprintf(buf, sizeof(buf), "\33[3~");
-        }
+    if (l->stale) {
+        l->n     = r->blank ? 0 : link_scan(r, x11->buf_w, l->at);
+        l->stale = false;
+    }
+
+    return l;
+}
+
+// the link cell (x, y) is on, NULL if none
+struct link *link_at(struct X11 *x11, int x, int y)
+{
+    struct row_links *l = links_row(x11, y);
+
+    for (int i = 0; i < l->n; i++)
+        if (x >= l->at[i].x0 && x <= l->at[i].x1)
+            return l->at + i;
+
+    return NULL;
+}
+
+bool link_hovered(const struct X11 *x11, int x, int y)
+{
+    return y == x11->hover_y && x >= x11->hover.x0 && x <= x11->hover.x1;
+}
+
+void x11_draw_cell(struct X11 *x11, struct cell *c, int x, int y, int cols,
+                   bool is_cursor)
+{
+    wchar_t       g[1 + CLUSTER_MAX];
+    int           glen = cell_text(c, g);
+    unsigned long bg = c->bg;
+    unsigned long fg = c->fg;
+    bool          bold = c->bold;
+    bool          italic = c->italic;
+    XFontSet      fs = bold   ? x11->xboldfontset
+                     : italic ? x11->xitalicfontset
+                              : x11->xfontset;
+
+    if (sel_has(x11, x, y)) swap(&fg, &bg);
+    if (is_cursor && x11->blink) swap(&fg, &bg);
+
+    XSetForeground(x11->dpy, x11->termgc, bg);
+
+    XFillRectangle(x11->dpy,
+                   x11->termwin,
+                   x11->termgc,
+                   x * x11->font_width,
+                   y * x11->font_height,
+                   cols * x11->font_width,
+                   x11->font_height);
+
+    XSetForeground(x11->dpy, x11->termgc, fg);
+
+    /* The base glyph, then each of its marks on top of it, one by one:
+     * charcell fonts give combining characters an advance of their own,
+     * drawn as one string they'd end up in the next cell, outside the
+     * rectangle we've just cleared. */
+    for (int i = 0; i < glen; i++) {
+        XwcDrawString(x11->dpy,
+                      x11->termwin,
+                      fs,
+                      x11->termgc,
+                      x * x11->font_width,
+                      y * x11->font_height + x11->font_yadg,
+                      g + i,
+                      1);
+    }
+
+    if (link_hovered(x11, x, y)) {
+        XDrawLine(x11->dpy,
+                  x11->termwin,
+                  x11->termgc,
+                  x * x11->font_width,
+                  (y + 1) * x11->font_height - 1,
+                  (x + cols) * x11->font_width - 1,
+                  (y + 1) * x11->font_height - 1);
+    }
+}
+
+/* Underlines the link under the pointer, and no longer the one that was
+ * there before. Nothing but the row the pointer is on is looked at. */
+void link_hover(struct X11 *x11)
+{
+    struct link *l   = NULL;
+    struct link  old = x11->hover;
+    int          y   = -1, old_y = x11->hover_y;
+
+    if (x11->pointer_y >= 0)
+        l = link_at(x11, x11->pointer_x, x11->pointer_y);
+    if (l != NULL)
+        y = x11->pointer_y;
+
+    // the same cells may hold another link now, colon and all
+    if (l != NULL)
+        x11->hover = *l;
+
+    if (y == old_y && (y == -1 || (l->x0 == old.x0 && l->x1 == old.x1)))
+        return;
+
+    x11->hover_y = y;
+
+    if (!x11->active)
+        return;
+
+    for (int i = 0; i < 2; i++) {
+        int                ly = i == 0 ? old_y : y;
+        const struct link *ll = i == 0 ? &old : l;
+
+        if (ly == -1)
+            continue;
+
+        // the old one may have been written over by wide glyphs since
+        for (int x = ll->x0; x <= ll->x1; x++) {
+            struct cell *c    = x11->rows[ly]->cells + x;
+            int          cols = c->wide && x + 1 < x11->buf_w ? 2 : 1;
+
+            if (c->wdummy)
+                continue;
+            x11_draw_cell(x11, c, x, ly, cols,
+                          x11->cur && ly == x11->buf_y &&
+                          x11->buf_x >= x && x11->buf_x < x + cols);
+        }
+    }
+
+    XFlush(x11->dpy);
+}
+
+// returns the number of cells painted
+size_t x11_redraw(struct X11 *x11)
+{
+    if (!x11->cur || !x11->active)
+        return 0;
+
+    size_t total = 0;
+    int     x, y;
+
+    if (x11->sel_rows != NULL)
+        sel_check(x11);
+
+    for (y = 0; y < x11->buf_h; y++) {
+        struct row *r   = x11->rows[y];
+        bool        all = x11->line_dirty[y];
+
+        x11->line_dirty[y] = false;
+
+        if (r->blank && !sel_on_row(x11, y)) {
+            // one rectangle instead of buf_w glyphs
+            if (all) {
+                total += x11->buf_w;
+                x11->links[y].stale = true;
+                XSetForeground(x11->dpy, x11->termgc, x11->blank.bg);
+                XFillRectangle(x11->dpy,
+                               x11->termwin,
+                               x11->termgc,
+                               0,
+                               y * x11->font_height,
+                               x11->buf_w * x11->font_width,
+                               x11->font_height);
+            }
+
+            if (y == x11->buf_y) {
+                total++;
+                x11_draw_cell(x11, r->cells + x11->buf_x, x11->buf_x, y, 1,
+                              true);
+                // paint over the cursor once it has moved on
+                x11->line_dirty[y] = true;
+            }
+            continue;
+        }
+
+        for (x = 0; x < x11->buf_w; x++) {
+            struct cell *c = r->cells + x;
+
+            // drawn together with the first half
+            if (c->wdummy && x > 0 && c[-1].wide) {
+                c->dirty = false;
+                continue;
+            }
+
+            int  cols      = c->wide && x + 1 < x11->buf_w ? 2 : 1;
+            bool is_cursor = y == x11->buf_y &&
+                             x11->buf_x >= x && x11->buf_x < x + cols;
+
+            if (!is_cursor && !all && !c->dirty &&
+                !(cols == 2 && c[1].dirty))
+                continue;
+
+            total += cols;
+            x11->links[y].stale = true;
+            x11_draw_cell(x11, c, x, y, cols, is_cursor);
+
+            if (is_cursor)
+                c->dirty = true;
+            else c->dirty = false;
+        }
+    }
+
+    // what's under the pointer may have changed along with the text
+    if (x11->pointer_y >= 0 && x11->links[x11->pointer_y].stale)
+        link_hover(x11);
+
+    if (x11->blink) {
+        XSetForeground(x11->dpy, x11->termgc, x11->col_fg);
+    }
+    else {
+        XSetForeground(x11->dpy, x11->termgc, x11->col_bk);
+    }
+
+    XFlush(x11->dpy);
+
+    return total;
+}
+
+/* Marks the cells under an exposed rectangle for redrawing. Expose events
+ * come in bursts, ev->count says how many more of the same burst are
+ * queued; the caller only redraws after the last one. */
+void x11_expose(struct X11 *x11, XExposeEvent *ev)
+{
+    int x0 = ev->x / x11->font_width;
+    int y0 = ev->y / x11->font_height;
+    int x1 = (ev->x + ev->width + x11->font_width - 1) / x11->font_width;
+    int y1 = (ev->y + ev->height + x11->font_height - 1) / x11->font_height;
+
+    x1 = x1 < x11->buf_w ? x1 : x11->buf_w;
+    y1 = y1 < x11->buf_h ? y1 : x11->buf_h;
+
+    for (int y = y0; y < y1; y++) {
+        struct row *r = x11->rows[y];
+
+        // blank rows are a single rectangle anyway
+        if (r->blank || (x0 == 0 && x1 == x11->buf_w))
+            x11->line_dirty[y] = true;
+        else
+            dirty_cells(r->cells + x0, r->cells + x1);
+    }
+}
+
+// repaints nothing but the cursor cell, for blinking
+void x11_draw_cursor(struct X11 *x11)
+{
+    if (!x11->cur || !x11->active)
+        return;
+
+    int          x = x11->buf_x;
+    struct cell *c = x11->rows[x11->buf_y]->cells + x;
+
+    if (c->wdummy && x > 0) {
+        --c;
+        --x;
+    }
+
+    int cols = c->wide && x + 1 < x11->buf_w ? 2 : 1;
+
+    x11_draw_cell(x11, c, x, x11->buf_y, cols, true);
+    XFlush(x11->dpy);
+}
+
+void x11_key(XKeyEvent *ev, struct PTY *pty, struct X11* x11)
+{
+    char   buf[32];
+    int    num;
+    KeySym ksym;
+
+    num      = XLookupString(ev, buf, sizeof(buf) - 1, &ksym, 0);
+    buf[num] = 0;
+
+    if (IsTtyFunctionOrSpaceKey(ksym)) {
+        printf("XKeyEvent non character = (%x) len() == %d\n", 0xFF & buf[0], num);
+        if(ksym == XK_BackSpace){
+            printf("XBackspace \n");
+            // backspace
+            num = snprintf(buf, sizeof(buf), "\33[3~");
+        }
     }
     else if (IsKeypad(ksym) != '\0') {
         printf("XKeyEvent arrow key\n");
@@ -583,11 +1531,6 @@ void x11_key(XKeyEvent *ev, struct PTY *pty, struct X11* x11)
         clear_all_cells(x11);
         x11_redraw(x11);
       } break;
-      case XK_Insert: {
-        print_screen(x11, bold_char);
-        print_screen(x11, italic_char);
-        print_screen(x11, ascii_char);
-      } break;
       default: {
         int ignore = write(pty->master, buf, num);
         (void)ignore;
@@ -596,246 +1539,725 @@ void x11_key(XKeyEvent *ev, struct PTY *pty, struct X11* x11)
 
 }
 
+/* While the pointer moves, the X server sends motion events by the
+ * pixel. Those that have piled up right behind ev are taken off the
+ * queue, only the latest position counts. */
+void x11_motion_latest(Display *dpy, XEvent *ev)
+{
+    XEvent next;
+
+    while (XPending(dpy)) {
+        XPeekEvent(dpy, &next);
+        if (next.type != MotionNotify ||
+            next.xmotion.window != ev->xmotion.window)
+            break;
+        XNextEvent(dpy, ev);
+    }
+}
 
-bool x11_setup(struct X11 *x11)
+// the cell under pixel (px, py), or the nearest one
+void x11_cell(struct X11 *x11, int px, int py, int *x, int *y)
 {
-    Colormap             cmap;
-    XColor               color;
-    Atom                 atom_net_wmname;
-    XSetWindowAttributes wa = {
-        .background_pixmap = ParentRelative,
-        .event_mask        = KeyPressMask | KeyReleaseMask | ExposureMask,
-    };
+    *x = px < 0 ? 0 : px / x11->font_width;
+    *y = py < 0 ? 0 : py / x11->font_height;
+    *x = *x < x11->buf_w ? *x : x11->buf_w - 1;
+    *y = *y < x11->buf_h ? *y : x11->buf_h - 1;
+}
 
-    x11->blink = true;
-    x11->cur   = true;
+/* Reports a button press or release, or the pointer moving, to the
+ * application, if its mouse mode asks for that. Returns false if it
+ * doesn't. With Shift held, the mouse is ours, for selecting.
+ *
+ * The pointer only gets reported when it has moved to another cell. */
+bool x11_mouse(XEvent *ev, struct PTY *pty, struct X11 *x11)
+{
+    char         buf[32];
+    int          len, b, x, y;
+    unsigned int state = ev->type == MotionNotify ? ev->xmotion.state
+                                                  : ev->xbutton.state;
+    bool         release = ev->type == ButtonRelease;
 
-    x11->dpy = XOpenDisplay(NULL);
-    if (x11->dpy == NULL) {
-        fprintf(stderr, "Cannot open display\n");
+    if (x11->mouse_mode == 0 || (state & ShiftMask))
         return false;
-    }
-
-    x11->screen = DefaultScreen(x11->dpy);
-    x11->root   = RootWindow(x11->dpy, x11->screen);
-    x11->fd     = ConnectionNumber(x11->dpy);
 
-    const char *font;
+    if (ev->type == MotionNotify) {
+        if (x11->mouse_mode == 1000)
+            return false;
 
-    font = "-*-fixed-medium-*-normal-*-*-140-*-*-*-90-*-";
-    font = "-*-fixed-medium-r-normal-*-13-*-*-*-*-*-*-1";
+        x     = ev->xmotion.x;
+        y     = ev->xmotion.y;
+        state = ev->xmotion.state;
+
+        // the lowest button held, 3 for none (only 1003 reports that)
+        if (state & Button1Mask)
+            b = 0;
+        else if (state & Button2Mask)
+            b = 1;
+        else if (state & Button3Mask)
+            b = 2;
+        else if (x11->mouse_mode == 1003)
+            b = 3;
+        else
+            return false;
+        b += 32;
+    }
+    else {
+        x = ev->xbutton.x;
+        y = ev->xbutton.y;
+
+        // buttons 4 and 5 are the wheel, 6 and 7 tilt it
+        if (ev->xbutton.button <= Button3)
+            b = ev->xbutton.button - Button1;
+        else if (ev->xbutton.button <= 7)
+            b = 64 + ev->xbutton.button - Button4;
+        else
+            return false;
 
-    char **missing_charsets;
-    int    num_missing_charsets;
-    char  *default_string;
+        // the wheel doesn't get released, as far as we're concerned
+        if (release && b >= 64)
+            return true;
+    }
 
-    x11->xfontset = XCreateFontSet(x11->dpy,
-                                   font,
-                                   &missing_charsets,
-                                   &num_missing_charsets,
-                                   &default_string);
+    x11_cell(x11, x, y, &x, &y);
 
-    font = "-*-fixed-bold-r-normal-*-13-*-*-*-*-*-*-1";
+    if (ev->type == MotionNotify && x == x11->mouse_x && y == x11->mouse_y)
+        return true;
+    x11->mouse_x = x;
+    x11->mouse_y = y;
 
-    x11->xboldfontset = XCreateFontSet(x11->dpy,
-                                       font,
-                                       &missing_charsets,
-                                       &num_missing_charsets,
-                                       &default_string);
+    if (state & Mod1Mask)
+        b += 8;
+    if (state & ControlMask)
+        b += 16;
 
-    font = "-*-fixed-*-o-*-*-13-*-*-*-*-*-*-1";
+    if (x11->mouse_sgr) {
+        len = snprintf(buf, sizeof(buf), "\33[<%d;%d;%d%c", b, x + 1, y + 1,
+                       release ? 'm' : 'M');
+    }
+    else {
+        // a byte each, no room for positions past 222, or which button
+        if (x + 1 > 255 - 32 || y + 1 > 255 - 32)
+            return true;
+        if (release)
+            b = (b & ~3) | 3;
+        len = snprintf(buf, sizeof(buf), "\33[M%c%c%c", 32 + b, 32 + x + 1,
+                       32 + y + 1);
+    }
 
-    x11->xitalicfontset = XCreateFontSet(x11->dpy,
-                                         font,
-                                         &missing_charsets,
-                                         &num_missing_charsets,
-                                         &default_string);
+    int ignore = write(pty->master, buf, len);
+    (void)ignore;
+    return true;
+}
 
-    XFontSetExtents* ext = XExtentsOfFontSet(x11->xfontset);
 
-    if (!ext) {
-        printf("Could not load font size\n");
-        exit(1);
-    }
+time_t monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
 
-    x11->font_width  = ext->max_logical_extent.width;
-    x11->font_height = ext->max_logical_extent.height;
-    x11->font_yadg   = -ext->max_logical_extent.y;
+long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
 
-    cmap = DefaultColormap(x11->dpy, x11->screen);
+/* An application that dies between the begin and end markers of a
+ * synchronized update must not freeze the screen for good. */
+#define SYNC_TIMEOUT_MS 150
 
-    if (!XAllocNamedColor(x11->dpy, cmap, "#000000", &color, &color)) {
-        fprintf(stderr, "Could not load bg color\n");
+/* Blinking means waking up every second, which adds up with lots of
+ * terminals open. So don't, unless someone could actually be looking at
+ * the cursor. */
+bool x11_cursor_blinks(struct X11 *x11)
+{
+    if (!x11->cur || !x11->blink_mode || !x11->focused || !x11->visible)
         return false;
-    }
-    x11->col_bg = color.pixel;
 
-    if (!XAllocNamedColor(x11->dpy, cmap, "#aaaaaa", &color, &color)) {
-        fprintf(stderr, "Could not load fg color\n");
-        return false;
-    }
+    return blink_idle == 0 ||
+           monotonic_seconds() - x11->last_activity < blink_idle;
+}
 
-    x11->col_fg     = color.pixel;
-    x11->sgr_fg_col = x11->col_fg;
-    x11->sgr_bg_col = x11->col_bg;
-    x11->sgr_bold   = false;
+/* Setup needs a reply from the server for every color and every atom.
+ * That's about 260 round trips if they're asked for one by one, which is
+ * noticeable on a remote display. */
+struct color_req {
+    unsigned short r, g, b;
+    unsigned long *pixel;
+};
+
+enum {
+    ATOM_NET_WM_NAME,
+    ATOM_UTF8_STRING,
+    ATOM_WM_PROTOCOLS,
+    ATOM_WM_DELETE_WINDOW,
+    ATOM_CLIPBOARD,
+    ATOM_TARGETS,
+    ATOM_INCR,
+    ATOM_TEXT,
+    ATOM_PASTE,
+    ATOM_COUNT
+};
 
-    if (!XAllocNamedColor(x11->dpy, cmap, "#444444", &color, &color)) {
-        fprintf(stderr, "Could not load blink color\n");
+static char *atom_names[ATOM_COUNT] = {
+    "_NET_WM_NAME", "UTF8_STRING", "WM_PROTOCOLS", "WM_DELETE_WINDOW",
+    "CLIPBOARD", "TARGETS", "INCR", "TEXT", "EDUTERM_PASTE"};
+
+#ifdef USE_XCB
+/* XCB hands out a cookie for each request instead of waiting for its
+ * reply. So send all of them first and only then collect the replies:
+ * one round trip in total. */
+bool x11_request_resources(struct X11 *x11, Colormap cmap,
+                           struct color_req *cols, int ncols, Atom *atoms)
+{
+    xcb_connection_t         *c = XGetXCBConnection(x11->dpy);
+    xcb_intern_atom_cookie_t  atom_cookies[ATOM_COUNT];
+    xcb_alloc_color_cookie_t *col_cookies;
+    bool                      ok = true;
+
+    col_cookies = malloc(ncols * sizeof(col_cookies[0]));
+    if (col_cookies == NULL) {
+        perror("malloc");
         return false;
     }
-    x11->col_bk = color.pixel;
 
-    for (int i = 0; i < (int)col_os_length; i++) {
-        XColor c;
-        c.red   = col_os_vals[i].r * 255;
-        c.green = col_os_vals[i].g * 255;
-        c.blue  = col_os_vals[i].b * 255;
-        if (!XAllocColor(x11->dpy, cmap, &c)) {
-            fprintf(stderr, "Could not load col_os[%d] color\n", i);
-            return false;
+    for (int i = 0; i < ATOM_COUNT; i++)
+        atom_cookies[i] = xcb_intern_atom(c, 0, strlen(atom_names[i]),
+                                          atom_names[i]);
+    for (int i = 0; i < ncols; i++)
+        col_cookies[i] = xcb_alloc_color(c, cmap, cols[i].r, cols[i].g,
+                                         cols[i].b);
+
+    // every cookie has to be collected, even after something failed
+    for (int i = 0; i < ATOM_COUNT; i++) {
+        xcb_generic_error_t     *e = NULL;
+        xcb_intern_atom_reply_t *r;
+
+        r = xcb_intern_atom_reply(c, atom_cookies[i], &e);
+        if (r == NULL) {
+            fprintf(stderr, "Could not intern atom %s\n", atom_names[i]);
+            ok = false;
+        } else {
+            atoms[i] = r->atom;
         }
-        x11->col_os[i] = c.pixel;
-        x11->col_256[i] = c.pixel;
+        free(r);
+        free(e);
     }
 
-    size_t col_map_dest = 16;
-    for (int r = 0; r < 6; r++) {
-        for (int g = 0; g < 6; g++) {
-            for (int b = 0; b < 6; b++) {
-                XColor c;
-                c.red   = (colorramp[r] * 255 / 31) * 255;
-                c.green = (colorramp[g] * 255 / 31) * 255;
-                c.blue  = (colorramp[b] * 255 / 31) * 255;
-                if (!XAllocColor(x11->dpy, cmap, &c)) {
-                    fprintf(stderr,
-                            "Could not load col_256[%d] color\n",
-                            (int)col_map_dest);
-                    return false;
-                }
-                x11->col_256[col_map_dest++] = c.pixel;
-            }
+    for (int i = 0; i < ncols; i++) {
+        xcb_generic_error_t     *e = NULL;
+        xcb_alloc_color_reply_t *r;
+
+        r = xcb_alloc_color_reply(c, col_cookies[i], &e);
+        if (r == NULL) {
+            fprintf(stderr, "Could not load color #%02x%02x%02x\n",
+                    cols[i].r >> 8, cols[i].g >> 8, cols[i].b >> 8);
+            ok = false;
+        } else {
+            *cols[i].pixel = r->pixel;
         }
+        free(r);
+        free(e);
     }
 
-    for (int i = 0; i < 24; i++) {
-        XColor c;
-        c.red = c.green = c.blue = (grayramp[i] * 255 / 31) * 255;
+    free(col_cookies);
+    return ok;
+}
+#else
+bool x11_request_resources(struct X11 *x11, Colormap cmap,
+                           struct color_req *cols, int ncols, Atom *atoms)
+{
+    // at least the atoms only take one round trip
+    if (!XInternAtoms(x11->dpy, atom_names, ATOM_COUNT, False, atoms)) {
+        fprintf(stderr, "Could not intern atoms\n");
+        return false;
+    }
+
+    for (int i = 0; i < ncols; i++) {
+        XColor c = {.red = cols[i].r, .green = cols[i].g, .blue = cols[i].b};
+
         if (!XAllocColor(x11->dpy, cmap, &c)) {
-            fprintf(stderr,
-                    "Could not load col_256[%d] color\n",
-                    (int)col_map_dest);
+            fprintf(stderr, "Could not load color #%02x%02x%02x\n",
+                    cols[i].r >> 8, cols[i].g >> 8, cols[i].b >> 8);
             return false;
         }
-        x11->col_256[col_map_dest++] = c.pixel;
+        *cols[i].pixel = c.pixel;
     }
 
-    /* The terminal will have a fixed size of 80x25 cells. This is an
-     * arbitrary number. No resizing has been implemented and child
-     * processes can't even ask us for the current size (for now).
+    return true;
+}
+#endif
+
+/* Sets up what's private to one terminal: the screen, the cursor and the
+ * SGR state. Needs the colors and fonts to be there already. */
+bool term_setup(struct X11 *x11)
+{
+    x11->blink         = true;
+    x11->cur           = true;
+    x11->blink_mode    = true;
+    x11->last_activity = monotonic_seconds();
+    x11->sync_update   = false;
+
+    x11->sgr_fg_col = x11->col_fg;
+    x11->blank = (struct cell){
+        .g  = L' ',
+        .fg = x11->col_fg,
+        .bg = x11->col_bg,
+    };
+    x11->sgr_bg_col = x11->col_bg;
+    x11->sgr_bold   = false;
+    x11->sgr_italic = false;
+
+    /* The terminal starts out with 80x45 cells unless --geometry says
+     * otherwise. A new tab takes the size of the one it's opened beside,
+     * which may have been resized (see term_resize()).
      *
      * buf_x, buf_y will be the current cursor position. */
-    x11->buf_w = 80;
-    x11->buf_h = 45;
+    if (x11->buf_w == 0 || x11->buf_h == 0) {
+        x11->buf_w = term_cols;
+        x11->buf_h = term_rows;
+    }
     x11->buf_x = x11->buf_alt_x = 0;
     x11->buf_y = x11->buf_alt_y = 0;
-    x11->buf   = calloc(x11->buf_w * x11->buf_h * sizeof(x11->buf[0]), 1);
-    clear_all_cells(x11);
-    dirty_all_cells(x11);
+    x11->blank_row  = malloc(sizeof(struct row) +
+                             x11->buf_w * sizeof(struct cell));
+    x11->line_dirty = calloc(x11->buf_h, sizeof(x11->line_dirty[0]));
+    x11->links      = malloc(x11->buf_h * sizeof(x11->links[0]));
 
-    if (x11->buf == NULL) {
+    if (x11->blank_row == NULL || x11->line_dirty == NULL ||
+        x11->links == NULL) {
         perror("calloc");
         return false;
     }
 
-    switch_buffers(x11);
+    x11->blank_row->refs  = 1;  // our own, a selection may outlive it
+    x11->blank_row->blank = true;
+    for (int x = 0; x < x11->buf_w; x++)
+        x11->blank_row->cells[x] = x11->blank;
 
-    x11->buf   = calloc(x11->buf_w * x11->buf_h * sizeof(x11->buf[0]), 1);
-    clear_all_cells(x11);
-    dirty_all_cells(x11);
+    // the alternate screen is only set up once it's first used
+    x11->rows       = alloc_rows(x11);
+    x11->rows_alt   = NULL;
+    x11->alt_active = false;
 
-    if (x11->buf == NULL) {
+    if (x11->rows == NULL) {
         perror("calloc");
         return false;
     }
 
+    dirty_all_cells(x11);
+    links_stale(x11);
+
     x11->application_keypad = false;
+    x11->mouse_mode         = 0;
+    x11->mouse_sgr          = false;
+    x11->bracketed_paste    = false;
+    x11->sel_mode           = SEL_NONE;
+    x11->sel_drag           = false;
+    x11->sel_rows           = NULL;
+    x11->pointer_x          = -1;
+    x11->pointer_y          = -1;
+    x11->hover_y            = -1;
 
     x11->scr_begin = 0;
     x11->scr_end   = x11->buf_h - 1;
 
-    x11->w = x11->buf_w * x11->font_width;
-    x11->h = x11->buf_h * x11->font_height;
-
-    x11->termwin = XCreateWindow(x11->dpy,
-                                 x11->root,
-                                 0,
-                                 0,
-                                 x11->w,
-                                 x11->h,
-                                 0,
-                                 DefaultDepth(x11->dpy, x11->screen),
-                                 CopyFromParent,
-                                 DefaultVisual(x11->dpy, x11->screen),
-                                 CWBackPixmap | CWEventMask,
-                                 &wa);
-    XMapWindow(x11->dpy, x11->termwin);
-    x11->termgc = XCreateGC(x11->dpy, x11->termwin, 0, NULL);
-
-    atom_net_wmname = XInternAtom(x11->dpy, "_NET_WM_NAME", False);
-    XChangeProperty(x11->dpy,
-                    x11->termwin,
-                    atom_net_wmname,
-                    XInternAtom(x11->dpy, "UTF8_STRING", False),
-                    8,
-                    PropModeReplace,
-                    (unsigned char *)"eduterm",
-                    strlen("eduterm"));
-
-    XSync(x11->dpy, False);
-
     return true;
 }
 
-bool spawn(struct PTY *pty)
+void term_free(struct X11 *x11)
 {
-    pid_t  p;
+    sel_clear(x11);
 
-    p = fork();
-    if (p == 0) {
-        close(pty->master);
+    for (int y = 0; y < x11->buf_h; y++) {
+        row_release(x11->rows[y]);
+        if (x11->rows_alt != NULL)
+            row_release(x11->rows_alt[y]);
+    }
 
-        /* Create a new session and make our terminal this process'
-         * controlling terminal. The shell that we'll spawn in a second
-         * will inherit the status of session leader. */
-        setsid();
-        if (ioctl(pty->slave, TIOCSCTTY, NULL) == -1) {
-            perror("ioctl(TIOCSCTTY)");
-            return false;
-        }
+    free(x11->rows);
+    free(x11->rows_alt);
+    row_release(x11->blank_row);
+    free(x11->line_dirty);
+    free(x11->links);
+}
 
-        dup2(pty->slave, 0);
-        dup2(pty->slave, 1);
-        dup2(pty->slave, 2);
-        close(pty->slave);
+// what fits of rows, from the top left, as rows of cols cells
+struct row **resize_rows(struct X11 *x11, struct row **rows,
+                         struct row *blank, int cols, int h)
+{
+    struct row **n = calloc(h, sizeof(n[0]));
+
+    if (n == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (int y = 0; y < h; y++) {
+        if (y >= x11->buf_h || rows[y]->blank) {
+            n[y] = row_ref(blank);
+            continue;
+        }
+
+        n[y] = malloc(sizeof(struct row) + cols * sizeof(struct cell));
+        if (n[y] == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        n[y]->refs  = 1;
+        n[y]->blank = false;
+        for (int x = 0; x < cols; x++)
+            n[y]->cells[x] = x < x11->buf_w ? rows[y]->cells[x] : x11->blank;
+
+        // half a wide glyph is no glyph
+        if (cols < x11->buf_w && n[y]->cells[cols - 1].wide)
+            n[y]->cells[cols - 1] = x11->blank;
+    }
+
+    for (int y = 0; y < x11->buf_h; y++)
+        row_release(rows[y]);
+    free(rows);
+
+    return n;
+}
+
+/* Gives the terminal a new size, keeping what fits of both screens. The
+ * window and the shell are up to the caller. */
+void term_resize(struct X11 *x11, int cols, int rows)
+{
+    struct row       *blank = malloc(sizeof(struct row) +
+                                     cols * sizeof(struct cell));
+    bool             *line_dirty = calloc(rows, sizeof(line_dirty[0]));
+    struct row_links *links = malloc(rows * sizeof(links[0]));
+
+    if (blank == NULL || line_dirty == NULL || links == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    sel_clear(x11);
+
+    blank->refs  = 1;
+    blank->blank = true;
+    for (int x = 0; x < cols; x++)
+        blank->cells[x] = x11->blank;
+
+    x11->rows = resize_rows(x11, x11->rows, blank, cols, rows);
+    if (x11->rows_alt != NULL)
+        x11->rows_alt = resize_rows(x11, x11->rows_alt, blank, cols, rows);
+
+    row_release(x11->blank_row);
+    free(x11->line_dirty);
+    free(x11->links);
+    x11->blank_row  = blank;
+    x11->line_dirty = line_dirty;
+    x11->links      = links;
+    x11->pointer_y  = -1;
+    x11->hover_y    = -1;
+
+    x11->buf_w     = cols;
+    x11->buf_h     = rows;
+    x11->buf_x     = x11->buf_x < cols ? x11->buf_x : cols - 1;
+    x11->buf_y     = x11->buf_y < rows ? x11->buf_y : rows - 1;
+    x11->buf_alt_x = x11->buf_alt_x < cols ? x11->buf_alt_x : cols - 1;
+    x11->buf_alt_y = x11->buf_alt_y < rows ? x11->buf_alt_y : rows - 1;
+    x11->scr_begin = 0;
+    x11->scr_end   = rows - 1;
+
+    x11->w = cols * x11->font_width;
+    x11->h = rows * x11->font_height;
+
+    dirty_all_cells(x11);
+    links_stale(x11);
+}
+
+void x11_set_title(struct X11 *x11, const char *title)
+{
+    XChangeProperty(x11->dpy,
+                    x11->termwin,
+                    x11->net_wm_name,
+                    x11->utf8_string,
+                    8,
+                    PropModeReplace,
+                    (unsigned char *)title,
+                    strlen(title));
+}
 
-        //putenv("TERM=xterm-256color");
+/* Opens the display and loads the fonts and colors. That's everything
+ * the terminals have in common, they take it from here (see tab_open()).
+ * There's no window yet. */
+bool x11_setup(struct X11 *x11)
+{
+    Colormap cmap;
+    Atom     atoms[ATOM_COUNT];
 
-        execlp(SHELL, "-"SHELL, NULL);
+    x11->dpy = XOpenDisplay(NULL);
+    if (x11->dpy == NULL) {
+        fprintf(stderr, "Cannot open display\n");
         return false;
     }
-    else if (p > 0) {
-        close(pty->slave);
-        return true;
+
+    x11->screen = DefaultScreen(x11->dpy);
+    x11->root   = RootWindow(x11->dpy, x11->screen);
+    x11->fd     = ConnectionNumber(x11->dpy);
+
+    // not to be inherited by the shells
+    fcntl(x11->fd, F_SETFD, FD_CLOEXEC);
+
+    const char *font;
+
+    font = "-*-fixed-medium-*-normal-*-*-140-*-*-*-90-*-";
+    font = "-*-fixed-medium-r-normal-*-13-*-*-*-*-*-*-1";
+
+    char **missing_charsets;
+    int    num_missing_charsets;
+    char  *default_string;
+
+    x11->xfontset = XCreateFontSet(x11->dpy,
+                                   font,
+                                   &missing_charsets,
+                                   &num_missing_charsets,
+                                   &default_string);
+
+    font = "-*-fixed-bold-r-normal-*-13-*-*-*-*-*-*-1";
+
+    x11->xboldfontset = XCreateFontSet(x11->dpy,
+                                       font,
+                                       &missing_charsets,
+                                       &num_missing_charsets,
+                                       &default_string);
+
+    font = "-*-fixed-*-o-*-*-13-*-*-*-*-*-*-1";
+
+    x11->xitalicfontset = XCreateFontSet(x11->dpy,
+                                         font,
+                                         &missing_charsets,
+                                         &num_missing_charsets,
+                                         &default_string);
+
+    XFontSetExtents* ext = XExtentsOfFontSet(x11->xfontset);
+
+    if (!ext) {
+        printf("Could not load font size\n");
+        exit(1);
     }
 
-    perror("fork");
-    return false;
+    x11->font_width  = ext->max_logical_extent.width;
+    x11->font_height = ext->max_logical_extent.height;
+    x11->font_yadg   = -ext->max_logical_extent.y;
+
+    cmap = DefaultColormap(x11->dpy, x11->screen);
+
+    /* XAllocNamedColor() takes "#aaaaaa" as 0xaa00 and so on, the other
+     * colors are scaled by 255 like they always were. */
+    struct color_req cols[3 + col_os_length + 6 * 6 * 6 + 24];
+    int              ncols = 0;
+
+    cols[ncols++] = (struct color_req){0x0000, 0x0000, 0x0000, &x11->col_bg};
+    cols[ncols++] = (struct color_req){0xaa00, 0xaa00, 0xaa00, &x11->col_fg};
+    cols[ncols++] = (struct color_req){0x4400, 0x4400, 0x4400, &x11->col_bk};
+
+    for (int i = 0; i < (int)col_os_length; i++) {
+        cols[ncols++] = (struct color_req){col_os_vals[i].r * 255,
+                                           col_os_vals[i].g * 255,
+                                           col_os_vals[i].b * 255,
+                                           &x11->col_os[i]};
+    }
+
+    size_t col_map_dest = 16;
+    for (int r = 0; r < 6; r++) {
+        for (int g = 0; g < 6; g++) {
+            for (int b = 0; b < 6; b++) {
+                cols[ncols++] = (struct color_req){
+                    (colorramp[r] * 255 / 31) * 255,
+                    (colorramp[g] * 255 / 31) * 255,
+                    (colorramp[b] * 255 / 31) * 255,
+                    &x11->col_256[col_map_dest++]};
+            }
+        }
+    }
+
+    for (int i = 0; i < 24; i++) {
+        unsigned short v = (grayramp[i] * 255 / 31) * 255;
+        cols[ncols++] = (struct color_req){v, v, v,
+                                           &x11->col_256[col_map_dest++]};
+    }
+
+    if (!x11_request_resources(x11, cmap, cols, ncols, atoms))
+        return false;
+
+    for (int i = 0; i < (int)col_os_length; i++)
+        x11->col_256[i] = x11->col_os[i];
+
+    x11->net_wm_name      = atoms[ATOM_NET_WM_NAME];
+    x11->utf8_string      = atoms[ATOM_UTF8_STRING];
+    x11->wm_protocols     = atoms[ATOM_WM_PROTOCOLS];
+    x11->wm_delete_window = atoms[ATOM_WM_DELETE_WINDOW];
+    x11->clipboard        = atoms[ATOM_CLIPBOARD];
+    x11->targets          = atoms[ATOM_TARGETS];
+    x11->incr             = atoms[ATOM_INCR];
+    x11->text             = atoms[ATOM_TEXT];
+    x11->paste_prop       = atoms[ATOM_PASTE];
+
+    /* Nothing here needs an answer from the server anymore, so don't wait
+     * for one. Errors still arrive through the event loop. */
+    XFlush(x11->dpy);
+
+    return true;
+}
+
+/* Motion events with or without a button held: for the application, for
+ * selecting and for underlining links. There are a lot of them while the
+ * pointer moves, but x11_event() only looks at the latest. */
+#define EVENT_MASK                                                      \
+    (KeyPressMask | KeyReleaseMask | ExposureMask | FocusChangeMask |   \
+     VisibilityChangeMask | ButtonPressMask | ButtonReleaseMask |       \
+     PointerMotionMask | LeaveWindowMask | PropertyChangeMask)
+
+// opens a window for a terminal that's been through term_setup()
+void x11_window(struct X11 *x11)
+{
+    XSetWindowAttributes wa = {
+        .background_pixmap = ParentRelative,
+        .event_mask        = EVENT_MASK,
+    };
+
+    x11->focused = true;
+    x11->visible = true;
+
+    x11->w = x11->buf_w * x11->font_width;
+    x11->h = x11->buf_h * x11->font_height;
+
+    x11->termwin = XCreateWindow(x11->dpy,
+                                 x11->root,
+                                 0,
+                                 0,
+                                 x11->w,
+                                 x11->h,
+                                 0,
+                                 DefaultDepth(x11->dpy, x11->screen),
+                                 CopyFromParent,
+                                 DefaultVisual(x11->dpy, x11->screen),
+                                 CWBackPixmap | CWEventMask,
+                                 &wa);
+    XMapWindow(x11->dpy, x11->termwin);
+    x11->termgc = XCreateGC(x11->dpy, x11->termwin, 0, NULL);
+
+    x11_set_title(x11, "eduterm");
+
+    /* Ask the window manager to tell us when the window is closed. Left
+     * to itself, it would kill our whole connection to the X server,
+     * taking every other window with it. XSetWMProtocols() would cost a
+     * round trip for the atom, we have that one already. */
+    XChangeProperty(x11->dpy,
+                    x11->termwin,
+                    x11->wm_protocols,
+                    XA_ATOM,
+                    32,
+                    PropModeReplace,
+                    (unsigned char *)&x11->wm_delete_window,
+                    1);
+}
+
+/* Starts the shell on the slave side, in directory cwd unless that's
+ * NULL.
+ *
+ * This used to be fork() and exec(). But fork() has to copy our page
+ * tables, which gets slower the more terminals we hold, only to throw
+ * them away again right after. posix_spawn() doesn't copy anything.
+ *
+ * It can't issue TIOCSCTTY in the child, though. Instead, the child
+ * creates a new session first (POSIX_SPAWN_SETSID) and then opens the
+ * slave by name, without O_NOCTTY: on Linux, a session leader without a
+ * controlling terminal that opens one gets it as its controlling
+ * terminal. The shell inherits the status of session leader. */
+bool spawn(struct PTY *pty, const char *cwd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t          attr;
+    sigset_t                   sigdefault;
+    char                      *shell[] = {"-"SHELL, NULL};
+    char                      *cmd[]   = {"/bin/sh", "-c", exec_cmd, NULL};
+    char                      *slave_name;
+    pid_t                      p;
+    int                        err;
+
+    slave_name = ptsname(pty->master);
+    if (slave_name == NULL) {
+        perror("ptsname");
+        return false;
+    }
+
+    // we ignore SIGCHLD, the shell shouldn't inherit that
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGCHLD);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID |
+                                    POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+
+    posix_spawn_file_actions_init(&actions);
+    if (cwd != NULL)
+        posix_spawn_file_actions_addchdir_np(&actions, cwd);
+    posix_spawn_file_actions_addopen(&actions, 0, slave_name, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&actions, 0, 1);
+    posix_spawn_file_actions_adddup2(&actions, 0, 2);
+    if (pty->slave > 2)
+        posix_spawn_file_actions_addclose(&actions, pty->slave);
+
+    //putenv("TERM=xterm-256color");
+
+    if (exec_cmd != NULL)
+        err = posix_spawn(&p, cmd[0], &actions, &attr, cmd, environ);
+    else
+        err = posix_spawn(&p, SHELL, &actions, &attr, shell, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(pty->slave);
+
+    if (err != 0) {
+        errno = err;
+        perror("posix_spawn");
+        return false;
+    }
+
+    return true;
 }
 
-bool is_final_csi_byte(char b)
+/* Starts a command of the user's (a trigger's or the one for links)
+ * and lets it run, in directory cwd unless that's NULL. */
+void run_command(char *const argv[], const char *cwd)
 {
-    return b >= 0x40 && b <= 0x7c;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t          attr;
+    sigset_t                   sigdefault;
+    pid_t                      pid;
+    int                        err;
+
+    // we ignore SIGCHLD, the command shouldn't inherit that
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGCHLD);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+
+    posix_spawn_file_actions_init(&actions);
+    if (cwd != NULL)
+        posix_spawn_file_actions_addchdir_np(&actions, cwd);
+
+    err = posix_spawn(&pid, argv[0], &actions, &attr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        errno = err;
+        perror("posix_spawn");
+    }
 }
 
 bool is_final_osi_byte(char b)
@@ -843,30 +2265,199 @@ bool is_final_osi_byte(char b)
     return b == 7;
 }
 
-int atoi_range(char *buf, size_t len, int def)
+/* Control sequences are decoded while the bytes come in, so handlers get
+ * plain integers instead of having to scanf() a string. A parameter that
+ * was left out ("CSI ;5H") is stored as -1. Sub-parameters use a colon
+ * instead of a semicolon ("CSI 38:2::255:0:0 m") and are flagged in
+ * sub[]. Anything past CSI_MAX_PARAMS is silently dropped. */
+#define CSI_MAX_PARAMS 32
+#define CSI_MAX_INTER  2
+#define CSI_MAX_VALUE  65535
+
+struct csi {
+    int    params[CSI_MAX_PARAMS];
+    bool   sub[CSI_MAX_PARAMS];
+    size_t nparams;
+    char   inter[CSI_MAX_INTER];
+    size_t ninter;
+    char   priv;   // private marker: '?', '>', '<', '=' or '\0'
+    char   final;
+};
+
+void csi_reset(struct csi *csi)
+{
+    csi->nparams   = 0;
+    csi->ninter    = 0;
+    csi->priv      = '\0';
+    csi->final     = '\0';
+    csi->params[0] = -1;
+    csi->sub[0]    = false;
+}
+
+// returns true once the final byte has been read
+bool csi_feed(struct csi *csi, char ch)
+{
+    unsigned char b = ch;
+
+    if (b >= '0' && b <= '9') {
+        if (csi->nparams == 0)
+            csi->nparams = 1;
+
+        size_t i = csi->nparams - 1;
+        if (i < CSI_MAX_PARAMS) {
+            int v = csi->params[i] < 0 ? 0 : csi->params[i];
+            v     = v * 10 + (b - '0');
+            csi->params[i] = v > CSI_MAX_VALUE ? CSI_MAX_VALUE : v;
+        }
+    }
+    else if (b == ';' || b == ':') {
+        // a leading separator means the first parameter was left out
+        if (csi->nparams == 0)
+            csi->nparams = 1;
+
+        if (csi->nparams < CSI_MAX_PARAMS) {
+            csi->params[csi->nparams] = -1;
+            csi->sub[csi->nparams]    = b == ':';
+        }
+        csi->nparams++;
+    }
+    else if (b >= 0x3c && b <= 0x3f) {
+        if (csi->nparams == 0 && csi->priv == '\0')
+            csi->priv = b;
+    }
+    else if (b >= 0x20 && b <= 0x2f) {
+        if (csi->ninter < CSI_MAX_INTER)
+            csi->inter[csi->ninter++] = b;
+    }
+    else if (b >= 0x40 && b <= 0x7e) {
+        csi->final = b;
+        if (csi->nparams > CSI_MAX_PARAMS)
+            csi->nparams = CSI_MAX_PARAMS;
+        return true;
+    }
+
+    return false;
+}
+
+/* Returns parameter i or def if it's missing. A zero means "default"
+ * for every sequence we know of, so it's treated the same way. */
+int csi_arg(const struct csi *csi, size_t i, int def)
+{
+    if (i >= csi->nparams || csi->params[i] <= 0)
+        return def;
+    return csi->params[i];
+}
+
+// number of colon separated sub-parameters following parameter i
+size_t csi_subparams(const struct csi *csi, size_t i)
+{
+    size_t n = 0;
+    while (i + 1 + n < csi->nparams && csi->sub[i + 1 + n])
+        n++;
+    return n;
+}
+
+void print_csi(const struct csi *csi)
+{
+    printf("Processing CSI '");
+    if (csi->priv)
+        putchar(csi->priv);
+    for (size_t i = 0; i < csi->nparams; i++) {
+        if (i > 0)
+            putchar(csi->sub[i] ? ':' : ';');
+        if (csi->params[i] >= 0)
+            printf("%d", csi->params[i]);
+    }
+    for (size_t i = 0; i < csi->ninter; i++)
+        putchar(csi->inter[i]);
+    printf("' op %c\n", csi->final);
+}
+
+// nearest entry of the xterm 256 color palette
+int rgb_to_256(int r, int g, int b)
+{
+    int cube[3], rgb[3] = {r, g, b};
+
+    for (int i = 0; i < 3; i++) {
+        int best = 0;
+        for (int j = 1; j < 6; j++) {
+            int lvl = colorramp[j] * 255 / 31;
+            int cur = colorramp[best] * 255 / 31;
+            if (abs(rgb[i] - lvl) < abs(rgb[i] - cur))
+                best = j;
+        }
+        cube[i] = best;
+    }
+
+    int cr = colorramp[cube[0]] * 255 / 31;
+    int cg = colorramp[cube[1]] * 255 / 31;
+    int cb = colorramp[cube[2]] * 255 / 31;
+    int cube_dist = (r - cr) * (r - cr) + (g - cg) * (g - cg) +
+                    (b - cb) * (b - cb);
+
+    int avg  = (r + g + b) / 3;
+    int gray = 0;
+    for (int j = 1; j < 24; j++) {
+        if (abs(avg - grayramp[j] * 255 / 31) <
+            abs(avg - grayramp[gray] * 255 / 31))
+            gray = j;
+    }
+    int gv        = grayramp[gray] * 255 / 31;
+    int gray_dist = (r - gv) * (r - gv) + (g - gv) * (g - gv) +
+                    (b - gv) * (b - gv);
+
+    if (gray_dist < cube_dist)
+        return 232 + gray;
+    return 16 + cube[0] * 36 + cube[1] * 6 + cube[2];
+}
+
+/* Extended colors, SGR 38 and 48. Both the semicolon form ("38;5;n",
+ * "38;2;r;g;b") and the colon form ("38:5:n", "38:2:cs:r:g:b") are
+ * accepted. *i points at the 38/48 and is advanced past the arguments
+ * that were consumed. */
+bool sgr_color(const struct csi *csi, size_t *i, struct X11 *x11,
+               unsigned long *col)
 {
-    int s = def;
-    if (len >= 1) {
-        s = atoi(buf);
+    size_t sub  = csi_subparams(csi, *i);
+    size_t j    = *i + 1;
+    int    kind = j < csi->nparams ? csi->params[j] : -1;
+    bool   ok   = false;
+
+    if (kind == 5) {
+        int idx = csi_arg(csi, j + 1, 0);
+        if (idx < 256) {
+            *col = x11->col_256[idx];
+            ok   = true;
+        }
+        if (sub == 0)
+            *i += 2;
     }
-    return s;
+    else if (kind == 2) {
+        // the colon form may carry a color space id before r:g:b
+        size_t k = sub >= 5 ? j + 2 : j + 1;
+        *col = x11->col_256[rgb_to_256(csi_arg(csi, k, 0),
+                                       csi_arg(csi, k + 1, 0),
+                                       csi_arg(csi, k + 2, 0))];
+        ok   = true;
+        if (sub == 0)
+            *i += 4;
+    }
+
+    *i += sub;
+    return ok;
 }
 
-void process_csi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
+void process_csi(struct csi *csi, struct X11 *x11, struct PTY *pty)
 {
-    char op = buf[len];
+    char op = csi->final;
 
     switch (op) {
       case 'm':
         break;
       default:
-        printf("Processing CSI '%s' op %c\n", buf, op);
+        print_csi(csi);
     }
 
-    struct cell *const lstart = x11->buf + x11->buf_w * x11->buf_y;
-    struct cell *const cursor = lstart + x11->buf_x;
-    struct cell *const lend   = lstart + x11->buf_w - 1;
-
     switch (op) {
       case '@': {
         // insert character into line
@@ -876,42 +2467,60 @@ void process_csi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
         //                   bend
         //  insert 2 : |---c123456|
         //             |---__c1234|
-        int num = atoi_range(buf, len - 1, 1);
-        for (struct cell *source = lend - num, *dest = lend; source >= cursor;
-             --dest, --source)
-            copy(dest, source);
+        if (x11->rows[x11->buf_y]->blank && erase_blank(x11))
+            break;
+
+        int num = csi_arg(csi, 0, 1);
+        num     = num < x11->buf_w - x11->buf_x ? num : x11->buf_w - x11->buf_x;
+        split_wide(x11, x11->buf_y, x11->buf_x);
 
-        for (struct cell *bend = cursor + num - 1; bend != cursor - 1;
-             --bend) 
-            clear(x11, bend);
+        struct cell *const lstart = row_mut(x11, x11->buf_y)->cells;
+        struct cell *const cursor = lstart + x11->buf_x;
+        struct cell *const lend   = lstart + x11->buf_w - 1;
+
+        memmove(cursor + num,
+                cursor,
+                (x11->buf_w - x11->buf_x - num) * sizeof(*cursor));
+        clear_cells(x11, cursor, cursor + num);
+
+        // a glyph pushed out of the line might have left half of itself
+        split_wide(x11, x11->buf_y, x11->buf_w);
+        dirty_cells(cursor, lend + 1);
 
       } break;
       case 'B':
       case 'A': {
-        int num = 1;
-        sscanf(buf, "%d", &num);
-        bool up = buf[num-1] == 'A';
+        int num = csi_arg(csi, 0, 1);
+        bool up = op == 'A';
         x11->buf_y += (up ? -1 : 1) * num;
         x11->buf_y = x11->buf_y > x11->buf_h - 1 ? x11->buf_h - 1 : x11->buf_y;
         x11->buf_y = x11->buf_y < 0 ? 0 : x11->buf_y;
       } break;
       case 'P': {
         // Delete characters
-        int num = 1;
-        sscanf(buf, "%dP", &num);
-        for (struct cell *source = cursor + num, *dest = cursor;
-             source != lend + 1;
-             ++source, ++dest)
-            copy(dest, source);
+        if (x11->rows[x11->buf_y]->blank && erase_blank(x11))
+            break;
+
+        int num = csi_arg(csi, 0, 1);
+        num     = num < x11->buf_w - x11->buf_x ? num : x11->buf_w - x11->buf_x;
+        split_wide(x11, x11->buf_y, x11->buf_x);
+        split_wide(x11, x11->buf_y, x11->buf_x + num);
+
+        struct cell *const lstart = row_mut(x11, x11->buf_y)->cells;
+        struct cell *const cursor = lstart + x11->buf_x;
+        struct cell *const lend   = lstart + x11->buf_w - 1;
+
+        memmove(cursor,
+                cursor + num,
+                (x11->buf_w - x11->buf_x - num) * sizeof(*cursor));
         clear_cells(x11 ,lend - (num-1), lend +1);
+        dirty_cells(cursor, lend + 1);
 
       } break;
       case 'm': {
         // SGR - Select Graphic Rendition
-        char *arg_s = strtok(buf, ";");
-        while (arg_s) {
-            int arg = atoi(arg_s);
-            arg_s   = strtok(NULL, ";");
+        for (size_t i = 0; i == 0 || i < csi->nparams; i++) {
+            int arg = csi_arg(csi, i, 0);
             switch (arg) {
               case 0:
                 x11->sgr_fg_col = x11->col_fg;
@@ -936,16 +2545,8 @@ void process_csi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
                 x11->sgr_fg_col = x11->col_os[arg - 30];
                 break;
               case 38:
-                arg             = atoi(arg_s);
-                arg_s           = strtok(NULL, ";");
-                if (arg == 5) {
-                    arg             = atoi(arg_s);
-                    arg_s           = strtok(NULL, ";");
-                    x11->sgr_fg_col = x11->col_256[arg];
-                }
-                else {
+                if (!sgr_color(csi, &i, x11, &x11->sgr_fg_col))
                     eexit(1);
-                }
                 break;
               case 40:
               case 41:
@@ -958,16 +2559,8 @@ void process_csi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
                 x11->sgr_bg_col = x11->col_os[arg - 40];
                 break;
               case 48:
-                arg             = atoi(arg_s);
-                arg_s           = strtok(NULL, ";");
-                if (arg == 5) {
-                    arg             = atoi(arg_s);
-                    arg_s           = strtok(NULL, ";");
-                    x11->sgr_bg_col = x11->col_256[arg];
-                }
-                else {
+                if (!sgr_color(csi, &i, x11, &x11->sgr_bg_col))
                     eexit(1);
-                }
                 break;
               case 91:
               case 92:
@@ -987,18 +2580,28 @@ void process_csi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
               case 107:
                 x11->sgr_bg_col = x11->col_os[arg - 100 + 8];
                 break;
+              default:
+                // skip sub-parameters of attributes we don't know
+                i += csi_subparams(csi, i);
+                break;
             }
         }
       } break;
       case 'J': {
-        int arg1 = 0;
-        sscanf(buf, "%dJ", &arg1);
-        if (arg1 == 2 || arg1 == 3) {
-            for (struct cell *a = x11->buf;
-                 a != x11->buf + x11->buf_w * x11->buf_h;
-                 ++a) {
-                clear(x11, a);
-            }
+        // Erase in Display
+        int arg1 = csi_arg(csi, 0, 0);
+        if (arg1 == 0) {
+            split_wide(x11, x11->buf_y, x11->buf_x);
+            erase_cells(x11, x11->buf_y, x11->buf_x, x11->buf_w);
+            erase_rows(x11, x11->buf_y + 1, x11->buf_h - 1);
+        }
+        else if (arg1 == 1) {
+            erase_rows(x11, 0, x11->buf_y - 1);
+            split_wide(x11, x11->buf_y, x11->buf_x + 1);
+            erase_cells(x11, x11->buf_y, 0, x11->buf_x + 1);
+        }
+        else if (arg1 == 2 || arg1 == 3) {
+            clear_all_cells(x11);
             x11->buf_x = 0;
             x11->buf_y = 0;
         }
@@ -1007,7 +2610,7 @@ void process_csi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
         }
       } break;
       case 'c': {
-        if (buf[0] == '>') {
+        if (csi->priv == '>') {
             const char* reply = "\e[>77;20805;0c";
             int  num = strlen(reply);
             int         ignore = write(pty->master, reply, num);
@@ -1018,87 +2621,121 @@ void process_csi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
         }
       } break;
       case 'C': {
-        int arg1 = 1;
-        sscanf(buf, "%dC", &arg1);
+        int arg1 = csi_arg(csi, 0, 1);
         x11->buf_x += arg1;
         x11->buf_x = x11->buf_x < x11->buf_w - 1 ? x11->buf_x : x11->buf_w - 1;
       } break;
       case 'H': {
-        int r = 1; int c = 1;
-        if (len > 1) {
-            sscanf(buf, "%d;%dH", &r, &c);
-        }
+        int r = csi_arg(csi, 0, 1);
+        int c = csi_arg(csi, 1, 1);
         x11->buf_x = c - 1;
         x11->buf_y = r - 1;
         x11->buf_x = x11->buf_x < x11->buf_w ? x11->buf_x : x11->buf_w - 1;
         x11->buf_y = x11->buf_y < x11->buf_h ? x11->buf_y : x11->buf_h - 1;
       } break;
       case 'K': {
-        int arg1 = 0;
-        sscanf(buf, "%dK", &arg1);
+        // Erase in Line
+        int arg1 = csi_arg(csi, 0, 0);
         switch (arg1) {
           case 0: {
-            for (struct cell *a = cursor; a != lend + 1; ++a) {
-                clear(x11, a);
-            }
+            split_wide(x11, x11->buf_y, x11->buf_x);
+            erase_cells(x11, x11->buf_y, x11->buf_x, x11->buf_w);
+          } break;
+          case 1: {
+            split_wide(x11, x11->buf_y, x11->buf_x + 1);
+            erase_cells(x11, x11->buf_y, 0, x11->buf_x + 1);
+          } break;
+          case 2: {
+            erase_row(x11, x11->buf_y);
           } break;
           default:
             eexit(1);
         }
       } break;
       case 'r': {
-        if (len >= 1) {
-            int start, end;
-            sscanf(buf, "%d;%dr", &start, &end);
-            x11->scr_begin = start - 1;
-            x11->scr_end   = end - 1;
-        }
-        else {
-            x11->scr_begin = 0;
-            x11->scr_end   = x11->buf_h - 1;
-        }
+        x11->scr_begin = csi_arg(csi, 0, 1) - 1;
+        x11->scr_end   = csi_arg(csi, 1, x11->buf_h) - 1;
         printf("Scroll region set to %d %d\n", x11->scr_begin, x11->scr_end);
       } break;
       case 'l': {
-        int arg1;
-        sscanf(buf, "?%dl", &arg1);
         // CSI ? P m l   DEC Private Mode Reset (DECRST)
-        if (arg1 == 25) {
-            //        P s = 2 5 → Hide Cursor (DECTCEM)
-            x11->cur = false;
-            printf("Hiding Cursor\n");
-        }
-        else if (arg1 == 12) {
-            // stop cursor blinking
+        for (size_t i = 0; i < csi->nparams; i++) {
+            int arg1 = csi_arg(csi, i, 0);
+            if (arg1 == 25) {
+                //        P s = 2 5 → Hide Cursor (DECTCEM)
+                x11->cur = false;
+                printf("Hiding Cursor\n");
+            }
+            else if (arg1 == 12) {
+                // stop cursor blinking
+                x11->blink_mode = false;
+            }
+            else if (arg1 == 2026) {
+                // end of a synchronized update, run() draws the frame
+                x11->sync_update = false;
+            }
+            else if (arg1 == 1000 || arg1 == 1002 || arg1 == 1003) {
+                x11->mouse_mode = 0;
+            }
+            else if (arg1 == 1006) {
+                x11->mouse_sgr = false;
+            }
+            else if (arg1 == 2004) {
+                x11->bracketed_paste = false;
+            }
+            else if (arg1 == 1049 && x11->alt_active) {
+                // back to the normal screen, the alternate one is dropped
+                clear_all_cells(x11);
+                switch_buffers(x11);
+                x11->alt_active = false;
+                dirty_all_cells(x11);
+            }
+            //else {
+            //    eexit(1);
+            //}
         }
-        //else {
-        //    eexit(1);
-        //}
       } break;
-      case 's':  
-        buf[len] = 'h';
-        __attribute__((fallthrough));
+      case 's':
       case 'h': {
         //  CSI ? P m h   DEC Private Mode Set (DECSET)
-        if (buf[0] != '?')
+        if (csi->priv != '?')
             eexit(1);
 
-        char *arg_s = strtok(buf+1, ";");
-        while (arg_s) {
-            int arg1 = atoi(arg_s);
-            arg_s    = strtok(NULL, ";");
+        for (size_t i = 0; i < csi->nparams; i++) {
+            int arg1 = csi_arg(csi, i, 0);
             switch (arg1) {
+              case 12: {
+                //  P s = 1 2 → Start Blinking Cursor (att610)
+                x11->blink_mode = true;
+              } break;
               case 1:
-              case 12:
-              case 1006:
-              case 1002:
-              case 5: 
-              case 2004: {
+              case 5: {
                 //  P s = 1 → Application Cursor Keys (DECCKM)
-                //  P s = 1 2 → Start Blinking Cursor (att610) 
-                // 1006,1002 mouse mode shenannigans
                 // 5 reverse video?
-		// 2004 bracketed paste mode
+              } break;
+              case 2004: {
+                //        P s = 2 0 0 4 → Set bracketed paste mode
+                x11->bracketed_paste = true;
+              } break;
+              case 1000:
+              case 1002:
+              case 1003: {
+                //        P s = 1 0 0 0 → Send Mouse X & Y on button press
+                //        and release
+                //        P s = 1 0 0 2 → Use Cell Motion Mouse Tracking
+                //        P s = 1 0 0 3 → Use All Motion Mouse Tracking
+                x11->mouse_mode = arg1;
+                x11->mouse_x    = -1;
+              } break;
+              case 1006: {
+                //        P s = 1 0 0 6 → Enable SGR Mouse Mode
+                x11->mouse_sgr = true;
+              } break;
+              case 2026: {
+                //        P s = 2 0 2 6 → Synchronized Output, hold back
+                //        drawing until it's reset again
+                x11->sync_update = true;
+                x11->sync_since  = monotonic_ms();
               } break;
               case 25: {
                 //        P s = 2 5 → Show Cursor (DECTCEM)
@@ -1118,7 +2755,16 @@ void process_csi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
                 //                        and 1048 modes.
                 //                        Use this with terminfo-based
                 //                        applications rather than the 47 mode.
-                switch_buffers(x11);
+                if (!x11->alt_active) {
+                    if (x11->rows_alt == NULL)
+                        x11->rows_alt = alloc_rows(x11);
+                    if (x11->rows_alt == NULL) {
+                        perror("calloc");
+                        break;
+                    }
+                    switch_buffers(x11);
+                    x11->alt_active = true;
+                }
                 clear_all_cells(x11);
                 dirty_all_cells(x11);
               } break;
@@ -1126,423 +2772,3641 @@ void process_csi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
                 eexit(1);
             }
         }
-      } break;
-      case 'M': {
-        int arg1 = 1;
-        sscanf(buf, "%dM", &arg1);
-        // delete arg1 lines
+      } break;
+      case 'M': {
+        int arg1 = csi_arg(csi, 0, 1);
+        // delete arg1 lines
+        if (x11->buf_y >= x11->scr_begin && x11->buf_y <= x11->scr_end)
+            rows_up(x11, x11->buf_y, x11->scr_end, arg1);
+      } break;
+      case 'L': {
+        int arg1 = csi_arg(csi, 0, 1);
+        // insert arg1 lines
+        printf("Insert %d lines\n", arg1);
+        if (x11->buf_y >= x11->scr_begin && x11->buf_y <= x11->scr_end)
+            rows_down(x11, x11->buf_y, x11->scr_end, arg1);
+      } break;
+      case 'n': {
+        // Device Status Report
+        int arg = csi_arg(csi, 0, 0);
+        if (arg == 6) {
+          char command[20];
+          size_t len;
+
+          len = snprintf(command,
+                         sizeof(command),
+                         "\e[%d;%dR",
+                         x11->buf_x + 1,
+                         x11->buf_y + 1);
+
+          int writ = write(pty->master, command, len);
+          (void) writ;
+        }
+        else if (arg == 5) {
+          char command[20];
+          size_t len;
+
+          len = snprintf(command,
+                         sizeof(command),
+                         "\e[0n");
+
+          int writ = write(pty->master, command, len);
+          (void) writ;
+        }
+        else {
+            eexit(1);
+        }
+      } break;
+      case 'p': {
+        // CSI ? P s $ p   Request DEC Private Mode (DECRQM)
+        if (csi->priv != '?' || csi->ninter != 1 || csi->inter[0] != '$') {
+            eexit(1);
+            break;
+        }
+
+        // 0 = not recognized, 1 = set, 2 = reset
+        int mode  = csi_arg(csi, 0, 0);
+        int state = 0;
+        if (mode == 2026)
+            state = x11->sync_update ? 1 : 2;
+        else if (mode == 1000 || mode == 1002 || mode == 1003)
+            state = x11->mouse_mode == mode ? 1 : 2;
+        else if (mode == 1006)
+            state = x11->mouse_sgr ? 1 : 2;
+
+        char   reply[32];
+        size_t len = snprintf(reply, sizeof(reply), "\e[?%d;%d$y", mode,
+                              state);
+        int    writ = write(pty->master, reply, len);
+        (void)writ;
+      } break;
+      case 't': {
+        // IGNORE
+        // Window manipulation (from dtterm, as well as extensions). These controls 
+        //      may be disabled using the allowWindowOps resource. Valid values for 
+        //      the first (and any additional parameters) are:
+      } break;      	
+      default: {
+        eexit(1);
+      } break;
+    }
+}
+
+void process_osi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
+{
+    (void)len;
+    (void)x11;
+    (void)pty;
+
+    for(char*a = buf; *a!= 0;++a) if(!isprint(*a)) *a = '?';
+
+    printf("Osi received '%s'\n", buf);
+}
+
+void scroll_up(struct X11 *x11)
+{
+    rows_up(x11, x11->scr_begin, x11->scr_end, 1);
+}
+
+void print_child_byte(char b)
+{
+    char printbuf[2];
+
+    if (b >= 32 && b <= 126)
+        printbuf[0] = b;
+    else
+        printbuf[0] = '?';
+
+    printbuf[1] = '\0';
+    printf("Child sent '%s' (%d) (0x%x)\n",
+           printbuf,
+           (int)b,
+           (unsigned char)b);
+}
+
+void wrap_line(struct X11 *x11)
+{
+    x11->buf_x = 0;
+    if (x11->buf_y >= x11->scr_end) {
+        scroll_up(x11);
+        x11->buf_y = x11->scr_end;
+    } else {
+        ++x11->buf_y;
+    }
+}
+
+// puts a glyph at the cursor and advances it, wrapping if need be
+void put_glyph(struct X11 *x11, wchar_t glyph, bool *just_wrapped)
+{
+    int width = glyph_width(glyph);
+
+    // the cell that was written last, i.e. left of the cursor
+    struct cell *prev = NULL;
+    int          px   = *just_wrapped ? x11->buf_x : x11->buf_x - 1;
+    if (px >= 0) {
+        prev = x11->rows[x11->buf_y]->cells + px;
+        if (prev->wdummy && px > 0)
+            --prev;
+    }
+
+    // zero width glyphs don't get a cell of their own
+    if (prev != NULL && (width == 0 || cluster_joins(prev))) {
+        int at = prev - x11->rows[x11->buf_y]->cells;
+        cluster_append(row_mut(x11, x11->buf_y)->cells + at, glyph);
+        return;
+    }
+    if (width == 0)
+        return;
+
+    if (*just_wrapped) {
+        *just_wrapped = false;
+        wrap_line(x11);
+    }
+
+    if (width == 2 && x11->buf_x + 1 >= x11->buf_w) {
+        // no room for both halves, leave the last column empty
+        split_wide(x11, x11->buf_y, x11->buf_x);
+        erase_cells(x11, x11->buf_y, x11->buf_x, x11->buf_x + 1);
+        wrap_line(x11);
+    }
+
+    split_wide(x11, x11->buf_y, x11->buf_x);
+    split_wide(x11, x11->buf_y, x11->buf_x + width);
+
+    struct cell *row = row_mut(x11, x11->buf_y)->cells;
+
+    putch(x11, glyph);
+
+    if (width == 2) {
+        row[x11->buf_x].wide = true;
+        x11->buf_x++;
+        putch(x11, L' ');
+        row[x11->buf_x].wdummy = true;
+    }
+
+    x11->buf_x++;
+
+    if (x11->buf_x >= x11->buf_w) {
+        *just_wrapped = true;
+        x11->buf_x    = x11->buf_w - 1;
+    }
+}
+
+/* Checks that buf only holds things that never move the cursor up:
+ * text, C0 controls, SGR, EL and charset designations. Anything else
+ * could bring lines back that we would like to skip. */
+bool jump_scroll_safe(const char *buf, size_t n)
+{
+    const char *p = buf, *end = buf + n;
+
+    while ((p = memchr(p, 27, end - p)) != NULL) {
+        if (++p == end)
+            return false;
+
+        if (*p == '(') {
+            if (++p == end)
+                return false;
+            ++p;
+            continue;
+        }
+
+        if (*p != '[')
+            return false;
+
+        for (++p; p != end && !(*p >= 0x40 && *p <= 0x7e); ++p)
+            if (*p < 0x20 || (*p >= 0x3c && *p <= 0x3f))
+                return false;
+
+        if (p == end || (*p != 'm' && *p != 'K'))
+            return false;
+        ++p;
+    }
+
+    return true;
+}
+
+/* What a newline does, given the text in front of it back to the last
+ * one, see newline_kind(). */
+enum {
+    NEWLINE_ADVANCES,   // goes to the next line
+    NEWLINE_SUPPRESSED, // follows an auto-wrap, so does nothing
+    NEWLINE_AS_BEFORE,  // whatever the newline before did
+    NEWLINE_UNKNOWN,
+};
+
+/* The parser ignores a newline that directly follows an auto-wrap (see
+ * just_wrapped in tab_feed()), and so must jump_scroll(). Whether the
+ * newline after line[0..n) is one depends on what's on the line: plain
+ * ASCII we follow glyph by glyph, from column x and with wrapped being
+ * just_wrapped at the start of the line. A CSI after the last glyph
+ * rules it out, as does an ASCII glyph first and no way to reach the
+ * last column after that. Anything else, we don't know. A line with
+ * neither glyphs nor CSIs leaves things as they were. */
+int newline_kind(const char *line, size_t n, int w, int x, bool wrapped)
+{
+    bool   ascii = true, glyphs = false, csi_last = false;
+    bool   first_ascii = false;
+    size_t cols = wrapped ? 0 : x;  // at most, outside of ASCII
+
+    for (size_t i = 0; i < n; i++) {
+        unsigned char b = line[i];
+
+        if (b == 27) {
+            if (i + 1 < n && line[i + 1] == '(') {
+                // the designation takes the newline for its character set
+                if ((i += 2) >= n)
+                    return NEWLINE_UNKNOWN;
+                continue;
+            }
+            for (i += 2; i < n && !(line[i] >= 0x40 && line[i] <= 0x7e); i++)
+                ;
+            if (i >= n)
+                return NEWLINE_UNKNOWN;
+            csi_last = true;
+            wrapped  = false;
+            continue;
+        }
+        if (b == '\r') {
+            x = 0;
+            continue;
+        }
+        if (b == '\t' || b == '\b' || b == '\a') {
+            ascii = false;
+            cols += b == '\t' ? 8 : 0;
+            continue;
+        }
+
+        // everything else ends up in put_glyph()
+        if (!glyphs)
+            first_ascii = b >= 0x20 && b < 0x7f;
+        glyphs   = true;
+        csi_last = false;
+        if (b < 0x20 || b >= 0x7f) {
+            ascii = false;
+            cols += 2;
+            continue;
+        }
+
+        cols++;
+        if (wrapped) {
+            x       = 0;
+            wrapped = false;
+        }
+        if (++x >= w) {
+            x       = w - 1;
+            wrapped = true;
+        }
+    }
+
+    if (!glyphs && !csi_last)
+        return NEWLINE_AS_BEFORE;
+    if (csi_last)
+        return NEWLINE_ADVANCES;
+    if (ascii)
+        return wrapped ? NEWLINE_SUPPRESSED : NEWLINE_ADVANCES;
+    if (first_ascii && cols < (size_t)w)
+        return NEWLINE_ADVANCES;
+    return NEWLINE_UNKNOWN;
+}
+
+/* Jump scroll: when the child floods us, most of what it sends scrolls
+ * off the screen before the next frame is drawn anyway. Any byte with at
+ * least buf_h newlines after it will never be seen, so there is no point
+ * in decoding it, putting it on the grid and scrolling it away again.
+ *
+ * This finds the buf_h-th newline counted from the end of buf and skips
+ * everything up to and including it, except for SGR which still has to
+ * be applied. The screen is then blanked and the cursor put into the
+ * bottom left corner, which is where the newline would have left it.
+ *
+ * Blanking the screen is only right if the skipped newlines alone push
+ * every row that's there now off the top. With the cursor above the
+ * bottom row, the first scr_end - buf_y of them merely move it down, so
+ * it takes that many more than buf_h.
+ *
+ * Only newlines that the parser wouldn't suppress count, see
+ * newline_kind(). Going backwards, we learn what a newline does once we
+ * get to a line that decides it; the ones in between are kept in lf[]
+ * until then. wrapped is the parser's just_wrapped.
+ *
+ * Returns the number of bytes consumed, 0 if there is nothing to skip.
+ * The parser must be in its ground state and the scroll region must be
+ * the whole screen. */
+size_t jump_scroll(struct X11 *x11, struct PTY *pty, const char *buf,
+                   size_t n, bool wrapped)
+{
+    if (x11->scr_begin != 0 || x11->scr_end != x11->buf_h - 1)
+        return 0;
+
+    int    need  = x11->buf_h - 1 + x11->buf_h + (x11->scr_end - x11->buf_y);
+    size_t lf[need];
+    size_t q     = n, skip = 0;
+    int    lines = 0, pending = 0;
+
+    do {
+        if (q == 0)
+            return 0;
+    } while (buf[--q] != '\n');
+
+    while (lines < need) {
+        size_t start = q;
+        int    kind;
+
+        while (start > 0 && buf[start - 1] != '\n')
+            start--;
+
+        if (start > 0) {
+            kind = newline_kind(buf + start, q - start, x11->buf_w, 0, false);
+        }
+        else {
+            // the line the cursor is on: the first glyph could join a
+            // cluster that's there already, which we don't follow
+            for (int x = 0; x < x11->buf_w; x++)
+                if (cluster_joins(x11->rows[x11->buf_y]->cells + x))
+                    return 0;
+
+            kind = newline_kind(buf, q, x11->buf_w, x11->buf_x, wrapped);
+            if (kind == NEWLINE_AS_BEFORE)
+                kind = wrapped ? NEWLINE_SUPPRESSED : NEWLINE_ADVANCES;
+        }
+
+        if (kind == NEWLINE_UNKNOWN)
+            return 0;
+
+        lf[pending++] = q;
+        if (kind != NEWLINE_AS_BEFORE) {
+            for (int i = 0; i < pending && kind == NEWLINE_ADVANCES; i++)
+                if (++lines == x11->buf_h)
+                    skip = lf[i] + 1;
+            pending = 0;
+        }
+        else if (pending == need) {
+            return 0;
+        }
+
+        if (start == 0)
+            break;
+        q = start - 1;
+    }
+
+    if (lines < need)
+        return 0;
+
+    if (!jump_scroll_safe(buf, n))
+        return 0;
+
+    // the colors have to be right for whatever comes after the skip
+    for (const char *p = buf, *end = buf + skip - 1;
+         (p = memchr(p, 27, end - p)) != NULL;) {
+        if (*++p != '[')
+            continue;
+
+        struct csi csi;
+        csi_reset(&csi);
+        while (!csi_feed(&csi, *++p))
+            ;
+        if (csi.final == 'm')
+            process_csi(&csi, x11, pty);
+    }
+
+    clear_all_cells(x11);
+    x11->buf_x = 0;
+    x11->buf_y = x11->buf_h - 1;
+
+    return skip;
+}
+
+/* Session logs (--log). Each tab's output goes to a log file of its own,
+ * raw or, with --log-text, stripped down to plain text.
+ *
+ * The parser must never wait for the disk. All it does is copy what the
+ * shell sent into a ring buffer, and a thread of the log's own writes it
+ * out from there. If the disk can't keep up and the ring fills up, the
+ * output that doesn't fit is dropped and counted, and a note in the log
+ * says where and how much. */
+
+#define LOG_RING (4 << 20)  // bytes, a power of two
+#define LOG_KEEP 5          // rotated logs, FILE.1 (newest) to FILE.5
+
+enum {
+    TEXT_PLAIN,
+    TEXT_ESC,
+    TEXT_CSI,
+    TEXT_STRING,      // OSC, DCS, ... up to BEL or ST
+    TEXT_STRING_ESC,
+};
+
+struct session_log {
+    char *path;
+    int   fd;
+    off_t size;
+    int   text_state;
+
+    char            *ring;
+    size_t           head, tail;  // only ever grow, the parser owns head
+    bool             closing;
+    pthread_t        thread;
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+
+    unsigned long dropped;        // since the last note, by the parser
+    unsigned long dropped_total;  // by the parser, ring full
+    unsigned long lost;           // by the writer, write errors
+};
+
+/* Follows a byte of output through escape sequences. Returns true if it
+ * is plain text: printable, a newline or a tab. Used for --log-text and
+ * the triggers. */
+bool text_keep(int *state, unsigned char b)
+{
+    // CAN and SUB cancel any sequence
+    if (b == 0x18 || b == 0x1a) {
+        *state = TEXT_PLAIN;
+        return false;
+    }
+
+    switch (*state) {
+      case TEXT_PLAIN:
+        if (b == '\033')
+            *state = TEXT_ESC;
+        else if (b == '\n' || b == '\t' || (b >= 0x20 && b != 0x7f))
+            return true;
+        break;
+      case TEXT_ESC:
+        if (b == '[')
+            *state = TEXT_CSI;
+        else if (b == ']' || b == 'P' || b == 'X' || b == '^' || b == '_')
+            *state = TEXT_STRING;
+        else if (b < 0x20 || b > 0x2f)  // not an intermediate byte
+            *state = TEXT_PLAIN;
+        break;
+      case TEXT_CSI:
+        if (b >= 0x40 && b <= 0x7e)
+            *state = TEXT_PLAIN;
+        break;
+      case TEXT_STRING:
+        if (b == '\a')
+            *state = TEXT_PLAIN;
+        else if (b == '\033')
+            *state = TEXT_STRING_ESC;
+        break;
+      case TEXT_STRING_ESC:
+        *state = b == '\\' ? TEXT_PLAIN : TEXT_STRING;
+        break;
+    }
+
+    return false;
+}
+
+// drops everything but plain text from buf, returns the new length
+size_t log_strip(struct session_log *lg, char *buf, size_t n)
+{
+    size_t out = 0;
+
+    for (size_t i = 0; i < n; i++)
+        if (text_keep(&lg->text_state, buf[i]))
+            buf[out++] = buf[i];
+
+    return out;
+}
+
+/* FILE becomes FILE.1, FILE.1 becomes FILE.2 and so on, the oldest one
+ * goes. Then we start over with an empty FILE. */
+void log_rotate(struct session_log *lg)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+
+    for (int i = LOG_KEEP; i > 0; i--) {
+        if (i > 1)
+            snprintf(from, sizeof(from), "%s.%d", lg->path, i - 1);
+        else
+            snprintf(from, sizeof(from), "%s", lg->path);
+        snprintf(to, sizeof(to), "%s.%d", lg->path, i);
+        rename(from, to);  // the older ones may not be there yet
+    }
+
+    close(lg->fd);
+    lg->fd = open(lg->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (lg->fd == -1)
+        perror(lg->path);
+    lg->size = 0;
+}
+
+// on the writer thread
+void log_flush(struct session_log *lg, char *buf, size_t n)
+{
+    if (log_text)
+        n = log_strip(lg, buf, n);
+
+    if (log_max > 0 && lg->size > 0 && lg->size + (off_t)n > log_max)
+        log_rotate(lg);
+
+    while (n > 0) {
+        ssize_t w = write(lg->fd, buf, n);
+
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w == -1) {
+            if (lg->lost == 0)
+                perror(lg->path);
+            lg->lost += n;
+            return;
+        }
+
+        buf += w;
+        n -= w;
+        lg->size += w;
+    }
+}
+
+void *log_writer(void *arg)
+{
+    struct session_log *lg = arg;
+
+    pthread_mutex_lock(&lg->lock);
+    for (;;) {
+        while (lg->head == lg->tail && !lg->closing)
+            pthread_cond_wait(&lg->cond, &lg->lock);
+        if (lg->head == lg->tail)
+            break;
+
+        // up to where the ring wraps around, the rest next time
+        size_t off = lg->tail & (LOG_RING - 1);
+        size_t n   = lg->head - lg->tail;
+        if (n > LOG_RING - off)
+            n = LOG_RING - off;
+
+        pthread_mutex_unlock(&lg->lock);
+        log_flush(lg, lg->ring + off, n);
+        pthread_mutex_lock(&lg->lock);
+
+        lg->tail += n;
+    }
+    pthread_mutex_unlock(&lg->lock);
+
+    return NULL;
+}
+
+void log_free(struct session_log *lg)
+{
+    if (lg->fd != -1)
+        close(lg->fd);
+    free(lg->ring);
+    free(lg->path);
+    free(lg);
+}
+
+/* The first tab logs to FILE, the ones after it to FILE-2, FILE-3 and
+ * so on. Logs are appended to, never truncated. */
+struct session_log *log_open(void)
+{
+    static unsigned     opened;
+    struct session_log *lg = calloc(1, sizeof(*lg));
+    struct stat         st;
+    int                 err;
+
+    if (lg == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    lg->fd = -1;
+
+    if (++opened == 1)
+        lg->path = strdup(log_path);
+    else if (asprintf(&lg->path, "%s-%u", log_path, opened) == -1)
+        lg->path = NULL;
+    if (lg->path == NULL) {
+        perror("strdup");
+        log_free(lg);
+        return NULL;
+    }
+
+    lg->fd = open(lg->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (lg->fd == -1 || fstat(lg->fd, &st) == -1) {
+        perror(lg->path);
+        log_free(lg);
+        return NULL;
+    }
+    lg->size = st.st_size;
+
+    lg->ring = aligned_alloc(4096, LOG_RING);
+    if (lg->ring == NULL) {
+        perror("aligned_alloc");
+        log_free(lg);
+        return NULL;
+    }
+
+    pthread_mutex_init(&lg->lock, NULL);
+    pthread_cond_init(&lg->cond, NULL);
+
+    err = pthread_create(&lg->thread, NULL, log_writer, lg);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_create");
+        log_free(lg);
+        return NULL;
+    }
+
+    return lg;
+}
+
+// CAN first, so the note doesn't end up inside a cut off sequence
+int log_note(struct session_log *lg, char *note, size_t size)
+{
+    return snprintf(note, size, "\030\r\n[eduterm: %lu bytes dropped]\r\n",
+                    lg->dropped);
+}
+
+// copies n bytes into the ring at head, returns the new head
+size_t log_copy(struct session_log *lg, size_t head, const char *buf,
+                size_t n)
+{
+    size_t off   = head & (LOG_RING - 1);
+    size_t first = n < LOG_RING - off ? n : LOG_RING - off;
+
+    memcpy(lg->ring + off, buf, first);
+    memcpy(lg->ring, buf + first, n - first);
+    return head + n;
+}
+
+/* Called by the parser with what the shell sent. Never blocks for longer
+ * than the writer takes to move its tail. */
+void log_write(struct session_log *lg, const char *buf, size_t n)
+{
+    size_t head = lg->head, used;
+    char   note[64];
+    int    len = 0;
+
+    pthread_mutex_lock(&lg->lock);
+    used = head - lg->tail;
+    pthread_mutex_unlock(&lg->lock);
+
+    if (lg->dropped > 0)
+        len = log_note(lg, note, sizeof(note));
+
+    if (used + len + n > LOG_RING) {
+        lg->dropped += n;
+        lg->dropped_total += n;
+        return;
+    }
+
+    head = log_copy(lg, head, note, len);
+    head = log_copy(lg, head, buf, n);
+    lg->dropped = 0;
+
+    pthread_mutex_lock(&lg->lock);
+    lg->head = head;
+    pthread_cond_signal(&lg->cond);
+    pthread_mutex_unlock(&lg->lock);
+}
+
+// writes out what's left and says so if anything was dropped
+void log_close(struct session_log *lg)
+{
+    char note[64];
+
+    pthread_mutex_lock(&lg->lock);
+    lg->closing = true;
+    pthread_cond_signal(&lg->cond);
+    pthread_mutex_unlock(&lg->lock);
+    pthread_join(lg->thread, NULL);
+
+    // the writer is gone, so it's our turn
+    if (lg->dropped > 0)
+        log_flush(lg, note, log_note(lg, note, sizeof(note)));
+
+    if (lg->dropped_total + lg->lost > 0)
+        fprintf(stderr, "%s: %lu bytes of output dropped, %lu lost\n",
+                lg->path, lg->dropped_total, lg->lost);
+
+    pthread_mutex_destroy(&lg->lock);
+    pthread_cond_destroy(&lg->cond);
+    log_free(lg);
+}
+
+/* Triggers (--triggers FILE): patterns that are looked for in the output
+ * of the shells as it comes in. On a match, a trigger rings the bell,
+ * highlights the line, runs a command or writes the line to a fifo. The
+ * file looks like this:
+ *
+ *     # a literal pattern
+ *     error:
+ *         bell
+ *         highlight
+ *     # an extended regular expression, between slashes
+ *     /FAIL(ED)?: [a-z_]+/
+ *         run notify-send "test failed" "$1"
+ *         fifo /tmp/failures
+ *
+ * A pattern starts at the beginning of a line, its actions are the
+ * indented lines below it. run gets the line that matched as $1.
+ *
+ * Matching is done on plain text, without escape sequences, a line at a
+ * time. There may be hundreds of patterns, so instead of trying them one
+ * by one, all literals go into a single Aho-Corasick automaton that sees
+ * every byte exactly once, whatever the number of patterns. Regular
+ * expressions are only run on lines that contain their longest literal
+ * part, if they have one (see regex_literal()). */
+
+#define TRIGGER_LINE_MAX  4096
+#define TRIGGER_HIGHLIGHT 58          // of the 256 colors, a dark yellow
+#define AC_HIT            0x80000000  // flags a state that ends a pattern
+
+struct trigger {
+    char   *pattern;  // as written in the file, for error messages
+    bool    is_regex;
+    regex_t re;
+    bool    gated;    // is_regex, and its literal part is in the automaton
+    bool    bell;
+    bool    highlight;
+    char   *run;
+    char   *fifo;
+};
+
+static struct trigger *triggers;
+static size_t          triggers_len, triggers_cap;
+static size_t         *ungated;  // the regexes without a literal
+static size_t          ungated_len;
+
+/* The automaton, a complete DFA over classes of bytes: bytes that don't
+ * occur in any pattern all share class 0, which keeps the table small.
+ * Transitions are stored as the offset of the next state's row, or'ed
+ * with AC_HIT if a pattern ends there. */
+static struct {
+    unsigned char cls[256];
+    unsigned      nclasses;
+    unsigned     *delta;
+    int          *out;      // per state, first trigger whose literal ends here
+    int          *out_next; // per trigger, next one ending at the same state
+    unsigned     *dict;     // per state, next state down the fail chain
+                            // with an output, 0 if none
+} ac;
+
+// per tab: where we are in the output
+struct trigger_scan {
+    unsigned       row;         // in ac.delta
+    int            text_state;
+    char           line[TRIGGER_LINE_MAX + 1];
+    size_t         line_len;
+    bool           highlight;   // the line is to be highlighted once done
+    unsigned char *mark;        // per trigger, TRIGGER_*
+    size_t        *touched;     // the triggers with marks on this line
+    size_t         touched_len;
+};
+
+enum {
+    TRIGGER_SEEN  = 1,  // its literal (or that of its regex) is in the line
+    TRIGGER_FIRED = 2,  // done for this line
+};
+
+/* The longest run of characters that every match of the regular
+ * expression re must contain, or NULL if there's none of at least three
+ * characters. Anything complicated (alternatives, groups, brackets,
+ * backslash classes) ends a run, which is always safe: a shorter literal
+ * only means the regex is tried more often. */
+char *regex_literal(const char *re)
+{
+    char   cur[TRIGGER_LINE_MAX], best[TRIGGER_LINE_MAX];
+    size_t cur_len = 0, best_len = 0;
+    int    depth   = 0;
+
+    for (const char *p = re; *p != '\0'; p++) {
+        char lit = '\0';
+
+        if (*p == '|' && depth == 0) {
+            return NULL;  // either side may match, neither is required
+        }
+        else if (*p == '(') {
+            depth++;
+        }
+        else if (*p == ')') {
+            depth--;
+        }
+        else if (*p == '[') {
+            p += p[1] == '^' ? 2 : 1;
+            if (*p == ']')
+                p++;
+            while (*p != '\0' && *p != ']') {
+                // "[:digit:]", "[=e=]" and "[.-.]" have a ']' of their own
+                if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+                    char        close[] = {p[1], ']', '\0'};
+                    const char *end     = strstr(p + 2, close);
+
+                    if (end == NULL)
+                        return NULL;
+                    p = end + 2;
+                    continue;
+                }
+                p++;
+            }
+            if (*p == '\0')
+                break;
+        }
+        else if (*p == '*' || *p == '?' || *p == '{') {
+            // the one before is optional after all
+            if (cur_len > 0)
+                cur_len--;
+            // and a bound ("{2}", "{2,3}") is no text
+            if (*p == '{')
+                while (p[1] != '\0' && *p != '}')
+                    p++;
+        }
+        else if (*p == '\\' && ispunct((unsigned char)p[1])) {
+            lit = *++p;
+        }
+        else if (*p == '\\' && p[1] != '\0') {
+            p++;
+        }
+        else if (*p != '.' && *p != '^' && *p != '$' && *p != '+') {
+            lit = *p;
+        }
+
+        if (lit != '\0' && depth == 0 && cur_len < sizeof(cur)) {
+            cur[cur_len++] = lit;
+            continue;
+        }
+
+        // anything else ends the run
+        if (cur_len > best_len) {
+            memcpy(best, cur, cur_len);
+            best_len = cur_len;
+        }
+        cur_len = 0;
+    }
+
+    if (cur_len > best_len) {
+        memcpy(best, cur, cur_len);
+        best_len = cur_len;
+    }
+
+    return best_len >= 3 ? strndup(best, best_len) : NULL;
+}
+
+/* Builds the automaton from the literals: those of the literal triggers
+ * and those regex_literal() found for the others. */
+bool ac_build(void)
+{
+    char   **lits = calloc(triggers_len, sizeof(lits[0]));
+    size_t   total = 1, nstates = 1;
+    unsigned *fail, *queue;
+    size_t    qhead = 0, qtail = 0;
+
+    if (lits == NULL) {
+        perror("calloc");
+        return false;
+    }
+
+    for (size_t i = 0; i < triggers_len; i++) {
+        struct trigger *tr = &triggers[i];
+
+        if (!tr->is_regex)
+            lits[i] = strdup(tr->pattern);
+        else
+            lits[i] = regex_literal(tr->pattern);
+        tr->gated = tr->is_regex && lits[i] != NULL;
+
+        for (const char *p = lits[i]; p != NULL && *p != '\0'; p++)
+            if (ac.cls[(unsigned char)*p] == 0)
+                ac.cls[(unsigned char)*p] = ++ac.nclasses;
+        if (lits[i] != NULL)
+            total += strlen(lits[i]);
+    }
+    ac.nclasses++;
+
+    ungated = malloc(triggers_len * sizeof(ungated[0]));
+    if (ungated == NULL) {
+        perror("malloc");
+        return false;
+    }
+    for (size_t i = 0; i < triggers_len; i++)
+        if (triggers[i].is_regex && !triggers[i].gated)
+            ungated[ungated_len++] = i;
+
+    ac.delta    = calloc(total * ac.nclasses, sizeof(ac.delta[0]));
+    ac.out      = malloc(total * sizeof(ac.out[0]));
+    ac.out_next = malloc(triggers_len * sizeof(ac.out_next[0]));
+    ac.dict     = calloc(total, sizeof(ac.dict[0]));
+    fail        = calloc(total, sizeof(fail[0]));
+    queue       = malloc(total * sizeof(queue[0]));
+    if (ac.delta == NULL || ac.out == NULL || ac.out_next == NULL ||
+        ac.dict == NULL || fail == NULL || queue == NULL) {
+        perror("malloc");
+        return false;
+    }
+
+    for (size_t s = 0; s < total; s++)
+        ac.out[s] = -1;
+
+    /* The trie first, by state number. A transition to state 0 means
+     * there's none yet, the root is never the child of anybody. */
+    for (size_t i = 0; i < triggers_len; i++) {
+        unsigned s = 0;
+
+        if (lits[i] == NULL)
+            continue;
+
+        for (const char *p = lits[i]; *p != '\0'; p++) {
+            unsigned *t = &ac.delta[s * ac.nclasses +
+                                    ac.cls[(unsigned char)*p]];
+            if (*t == 0)
+                *t = nstates++;
+            s = *t;
+        }
+
+        ac.out_next[i] = ac.out[s];
+        ac.out[s]      = i;
+        free(lits[i]);
+    }
+    free(lits);
+
+    /* Then, breadth first, fill in the missing transitions with those of
+     * the fail state, the longest proper suffix that is in the trie. */
+    for (unsigned c = 0; c < ac.nclasses; c++)
+        if (ac.delta[c] != 0)
+            queue[qtail++] = ac.delta[c];
+
+    while (qhead < qtail) {
+        unsigned s = queue[qhead++];
+
+        ac.dict[s] = ac.out[fail[s]] != -1 ? fail[s] : ac.dict[fail[s]];
+
+        for (unsigned c = 0; c < ac.nclasses; c++) {
+            unsigned *t = &ac.delta[s * ac.nclasses + c];
+
+            if (*t != 0) {
+                fail[*t]        = ac.delta[fail[s] * ac.nclasses + c];
+                queue[qtail++] = *t;
+            }
+            else {
+                *t = ac.delta[fail[s] * ac.nclasses + c];
+            }
+        }
+    }
+
+    // now as row offsets, flagged where a pattern ends
+    for (size_t i = 0; i < nstates * ac.nclasses; i++) {
+        unsigned t = ac.delta[i];
+        ac.delta[i] = t * ac.nclasses;
+        if (ac.out[t] != -1 || ac.dict[t] != 0)
+            ac.delta[i] |= AC_HIT;
+    }
+
+    free(fail);
+    free(queue);
+    return true;
+}
+
+struct trigger *trigger_add(const char *pattern)
+{
+    struct trigger *tr;
+
+    if (triggers_len >= triggers_cap) {
+        size_t          cap = triggers_cap ? triggers_cap * 2 : 16;
+        struct trigger *n   = realloc(triggers, cap * sizeof(triggers[0]));
+
+        if (n == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        triggers     = n;
+        triggers_cap = cap;
+    }
+
+    tr = &triggers[triggers_len++];
+    memset(tr, 0, sizeof(*tr));
+    tr->pattern = strdup(pattern);
+    if (tr->pattern == NULL) {
+        perror("strdup");
+        return NULL;
+    }
+    return tr;
+}
+
+// reads the triggers from path and builds the automaton
+bool trigger_load(const char *path)
+{
+    FILE           *f = fopen(path, "r");
+    char           *line = NULL;
+    size_t          size = 0;
+    ssize_t         len;
+    int             lineno = 0;
+    struct trigger *tr = NULL;
+    bool            ok = true;
+
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+
+    while (ok && (len = getline(&line, &size, f)) != -1) {
+        lineno++;
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+
+        if (len == 0 || line[0] == '#')
+            continue;
+
+        if (line[0] != ' ' && line[0] != '\t') {
+            if (tr != NULL && !tr->bell && !tr->highlight && !tr->run &&
+                !tr->fifo) {
+                fprintf(stderr, "%s:%d: '%s' has no actions\n", path,
+                        lineno - 1, tr->pattern);
+                ok = false;
+                break;
+            }
+
+            bool is_regex = len >= 2 && line[0] == '/' && line[len - 1] == '/';
+            if (is_regex)
+                line[len - 1] = '\0';
+
+            tr = trigger_add(is_regex ? line + 1 : line);
+            if (tr == NULL) {
+                ok = false;
+                break;
+            }
+
+            tr->is_regex = is_regex;
+            if (is_regex) {
+                int err = regcomp(&tr->re, tr->pattern,
+                                  REG_EXTENDED | REG_NOSUB);
+                if (err != 0) {
+                    char msg[256];
+                    regerror(err, &tr->re, msg, sizeof(msg));
+                    fprintf(stderr, "%s:%d: %s\n", path, lineno, msg);
+                    triggers_len--;
+                    ok = false;
+                }
+            }
+            continue;
+        }
+
+        char *action = line + strspn(line, " \t");
+        char *arg    = action + strcspn(action, " \t");
+        if (*arg != '\0')
+            *arg++ = '\0';
+        arg += strspn(arg, " \t");
+
+        if (tr == NULL) {
+            fprintf(stderr, "%s:%d: action without a pattern\n", path,
+                    lineno);
+            ok = false;
+        }
+        else if (*action == '\0') {
+            continue;
+        }
+        else if (strcmp(action, "bell") == 0 && *arg == '\0') {
+            tr->bell = true;
+        }
+        else if (strcmp(action, "highlight") == 0 && *arg == '\0') {
+            tr->highlight = true;
+        }
+        else if (strcmp(action, "run") == 0 && *arg != '\0') {
+            free(tr->run);
+            tr->run = strdup(arg);
+        }
+        else if (strcmp(action, "fifo") == 0 && *arg != '\0') {
+            free(tr->fifo);
+            tr->fifo = strdup(arg);
+        }
+        else {
+            fprintf(stderr, "%s:%d: unknown action '%s'\n", path, lineno,
+                    action);
+            ok = false;
+        }
+    }
+
+    if (ok && tr != NULL && !tr->bell && !tr->highlight && !tr->run &&
+        !tr->fifo) {
+        fprintf(stderr, "%s:%d: '%s' has no actions\n", path, lineno,
+                tr->pattern);
+        ok = false;
+    }
+
+    free(line);
+    fclose(f);
+
+    // nothing to look for, the tabs won't even get a trigger_scan
+    return ok && (triggers_len == 0 || ac_build());
+}
+
+struct trigger_scan *trigger_scan_new(void)
+{
+    struct trigger_scan *sc = calloc(1, sizeof(*sc));
+
+    if (sc == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    sc->mark    = calloc(triggers_len, sizeof(sc->mark[0]));
+    sc->touched = calloc(triggers_len, sizeof(sc->touched[0]));
+    if (sc->mark == NULL || sc->touched == NULL) {
+        perror("calloc");
+        free(sc->mark);
+        free(sc->touched);
+        free(sc);
+        return NULL;
+    }
+
+    return sc;
+}
+
+void trigger_scan_free(struct trigger_scan *sc)
+{
+    free(sc->mark);
+    free(sc->touched);
+    free(sc);
+}
+
+void trigger_mark(struct trigger_scan *sc, size_t i, unsigned char m)
+{
+    if (sc->mark[i] == 0)
+        sc->touched[sc->touched_len++] = i;
+    sc->mark[i] |= m;
+}
+
+// the literals that end where the automaton is now, in state s
+void trigger_seen(struct trigger_scan *sc, unsigned s)
+{
+    for (; s != 0; s = ac.dict[s])
+        for (int i = ac.out[s]; i != -1; i = ac.out_next[i])
+            trigger_mark(sc, i, TRIGGER_SEEN);
+}
+
+/* Everything the parser has to remember from one read to the next. */
+struct parser {
+    bool just_wrapped;
+    bool add_newline;
+    bool read_escape_mode;
+    bool read_csi;
+    bool read_osi;
+    bool read_charset;
+
+    struct csi csi;
+
+    char   osi_buf[200];
+    size_t osi_buf_i;
+
+    struct utf8 utf8;
+};
+
+/* One terminal. Each tab has its own shell, screen and parser, everything
+ * else is shared (see struct X11). A window holds one or more tabs, one
+ * of them is on screen. The others keep parsing their output, they just
+ * don't draw it. */
+struct tab {
+    struct PTY            pty;
+    struct X11            x11;
+    struct parser         parser;
+    struct session_log   *log;     // NULL without --log
+    struct trigger_scan  *scan;    // NULL without --triggers
+    struct screen_export *export;  // NULL until a client asks for it
+    int                   export_fd;
+    struct row          **export_rows;  // see export_update()
+
+    // pasted text on its way to the shell, see paste_queue()
+    char                 *paste;
+    size_t                paste_len, paste_off, paste_cap;
+    bool                  paste_incr;  // more to come, see paste_read()
+};
+
+static struct tab **tabs;
+static size_t       tabs_len, tabs_cap;
+static struct X11   x11_shared;  // display, fonts and colors, no window
+
+/* The screen export: the cells of a tab's screen in shared memory, for a
+ * client to map and look at whenever it likes, without asking. Laid out
+ * as struct screen_export, then rows * cols of struct export_cell.
+ *
+ * We update it after every change to the screen, the rows that have
+ * changed, that is. seq is odd while we're at it; a reader copies what
+ * it needs, and if seq was odd or changed in the meantime, tries again.
+ * After a resize, the export is stale for good and a new one has to be
+ * asked for. */
+#define EXPORT_MAGIC 0x74756465  // "edut"
+
+struct screen_export {
+    uint32_t         magic;
+    _Atomic uint32_t seq;
+    uint32_t         stale;
+    uint32_t         cols, rows;
+    uint32_t         cursor_x, cursor_y;
+    uint32_t         reserved;
+};
+
+struct export_cell {
+    uint32_t g;       // code point, 0 for the right half of a wide glyph
+    uint32_t fg, bg;  // X pixel values, 0xRRGGBB on TrueColor displays
+    uint32_t attr;    // EXPORT_BOLD, ...
+};
+
+enum {
+    EXPORT_BOLD   = 1,
+    EXPORT_ITALIC = 2,
+    EXPORT_WIDE   = 4,
+};
+
+/* Copies the tab's screen into its export, if it has one. We hold on to
+ * the rows we copied, as the selection does: a row that's written to
+ * gets copied first (see row_mut()), so if a row is still the one we
+ * have, there's nothing new in it.
+ *
+ * A row that has scrolled up is further down in the export already, and
+ * is moved rather than copied from the screen again. Going from the top,
+ * that's always a place we haven't got to yet. */
+void export_update(struct tab *t)
+{
+    struct screen_export *ex    = t->export;
+    struct export_cell   *cells, *ec;
+    size_t                w     = t->x11.buf_w;
+    int                   shift = 0;  // how far the rows have scrolled up
+    uint32_t              seq;
+
+    if (ex == NULL)
+        return;
+    cells = (struct export_cell *)(ex + 1);
+
+    seq = atomic_load_explicit(&ex->seq, memory_order_relaxed);
+    atomic_store_explicit(&ex->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    ex->cursor_x = t->x11.buf_x;
+    ex->cursor_y = t->x11.buf_y;
+
+    for (int y = 0; y < t->x11.buf_h; y++) {
+        struct row        *r = t->x11.rows[y];
+        const struct cell *c = r->cells;
+
+        if (t->export_rows[y] == r)
+            continue;
+
+        for (int d = 1; shift == 0 && y + d < t->x11.buf_h; d++) {
+            if (t->export_rows[y + d] == r)
+                shift = d;
+        }
+
+        if (t->export_rows[y] != NULL)
+            row_release(t->export_rows[y]);
+        t->export_rows[y] = row_ref(r);
+
+        ec = cells + y * w;
+        if (shift > 0 && y + shift < t->x11.buf_h &&
+            t->export_rows[y + shift] == r) {
+            memcpy(ec, cells + (y + shift) * w, w * sizeof(*ec));
+            continue;
+        }
+
+        for (size_t x = 0; x < w; x++, c++, ec++) {
+            ec->g    = c->wdummy ? 0 : c->g;
+            ec->fg   = c->fg;
+            ec->bg   = c->bg;
+            ec->attr = (c->bold ? EXPORT_BOLD : 0) |
+                       (c->italic ? EXPORT_ITALIC : 0) |
+                       (c->wide ? EXPORT_WIDE : 0);
+        }
+    }
+
+    atomic_store_explicit(&ex->seq, seq + 2, memory_order_release);
+}
+
+size_t export_size(struct X11 *x11)
+{
+    return sizeof(struct screen_export) +
+           (size_t)x11->buf_w * x11->buf_h * sizeof(struct export_cell);
+}
+
+/* Sets up the tab's export if it has none yet. Returns a read-only file
+ * descriptor for it, -1 on failure. */
+int export_open(struct tab *t)
+{
+    char path[64];
+    int  fd;
+
+    if (t->export == NULL) {
+        size_t size = export_size(&t->x11);
+        void  *mem;
+
+        fd = memfd_create("eduterm-screen", MFD_CLOEXEC);
+        if (fd == -1) {
+            perror("memfd_create");
+            return -1;
+        }
+
+        if (ftruncate(fd, size) == -1) {
+            perror("ftruncate");
+            close(fd);
+            return -1;
+        }
+
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+
+        // none copied yet, so the first update copies all of them
+        t->export_rows = calloc(t->x11.buf_h, sizeof(t->export_rows[0]));
+        if (t->export_rows == NULL) {
+            perror("calloc");
+            munmap(mem, size);
+            close(fd);
+            return -1;
+        }
+
+        t->export        = mem;
+        t->export_fd     = fd;
+        t->export->magic = EXPORT_MAGIC;
+        t->export->cols  = t->x11.buf_w;
+        t->export->rows  = t->x11.buf_h;
+        export_update(t);
+    }
+
+    // opened again, read-only: the client can't write to what it gets
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", t->export_fd);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        perror(path);
+    return fd;
+}
+
+// the clients that have it mapped find out from stale
+void export_close(struct tab *t)
+{
+    if (t->export == NULL)
+        return;
+
+    for (uint32_t y = 0; y < t->export->rows; y++) {
+        if (t->export_rows[y] != NULL)
+            row_release(t->export_rows[y]);
+    }
+    free(t->export_rows);
+    t->export_rows = NULL;
+
+    t->export->stale = 1;
+    munmap(t->export, sizeof(struct screen_export) +
+                      (size_t)t->export->cols * t->export->rows *
+                          sizeof(struct export_cell));
+    close(t->export_fd);
+    t->export = NULL;
+}
+
+/* Copy and paste. Button 1 selects: by character, by word on a double
+ * click, by line on a triple one, and a block with Alt held. Letting go
+ * of the button makes the selection PRIMARY, Ctrl+Shift+C makes it the
+ * CLIPBOARD, too. Button 2 and Shift+Insert paste PRIMARY,
+ * Ctrl+Shift+V pastes the CLIPBOARD. With nothing selected,
+ * Ctrl+Shift+C copies the link under the pointer instead. */
+
+#define DOUBLE_CLICK_MS 400
+#define SEL_CHUNK       (64 << 10)   // bytes per property, more by INCR
+#define SEL_IDLE_MS     30000        // a transfer that's stuck this long
+#define TRANSFERS_MAX   16
+
+/* The text of a selection we own, for other clients. It's not kept as
+ * text: we hold on to the rows it's on (they don't change, see
+ * row_mut()) and turn them into text as it's asked for, a chunk at a
+ * time. A selection of many megabytes is never in memory as a whole. */
+struct sel_source {
+    int          refs;
+    Window       owner;
+    struct row **rows;
+    int          nrows, cols;
+    int          x0, x1;  // start on the first row, end on the last
+    bool         block;
+};
+
+/* A transfer of a selection to another client that's too big for a
+ * single property, by the ICCCM's INCR protocol: we put a chunk into
+ * the property, the requestor deletes it, we put the next one, until an
+ * empty one says that was it. */
+struct sel_transfer {
+    Window             requestor;
+    Atom               property;
+    struct sel_source *src;
+    int                row;    // the next one to turn into text
+    char              *chunk;  // up next, once the property is deleted
+    size_t             len;
+    bool               done;   // all that's left is the empty chunk
+    long               since;  // monotonic_ms() of the last step
+};
+
+static struct sel_source   *sel_primary, *sel_clipboard;
+static struct sel_transfer *transfers[TRANSFERS_MAX];
+static size_t               transfers_len;
+
+// n rows of the screen of x11, from x0 on the first to x1 on the last
+struct sel_source *sel_source_new(struct X11 *x11, struct row **rows, int n,
+                                  int x0, int x1, bool block)
+{
+    struct sel_source *src = calloc(1, sizeof(*src));
+
+    if (src == NULL || (src->rows = malloc(n * sizeof(src->rows[0]))) == NULL) {
+        perror("malloc");
+        free(src);
+        return NULL;
+    }
+
+    src->refs  = 1;
+    src->owner = x11->termwin;
+    src->nrows = n;
+    src->cols  = x11->buf_w;
+    src->x0    = x0;
+    src->x1    = x1;
+    src->block = block;
+    for (int i = 0; i < n; i++)
+        src->rows[i] = row_ref(rows[i]);
+
+    return src;
+}
+
+// what's selected on the screen of x11, NULL if nothing is
+struct sel_source *sel_selected(struct X11 *x11)
+{
+    if (x11->sel_rows == NULL)
+        return NULL;
+
+    return sel_source_new(x11, x11->sel_rows, x11->sel_y1 - x11->sel_y0 + 1,
+                          x11->sel_x0, x11->sel_x1, x11->sel_block);
+}
+
+void sel_source_unref(struct sel_source *src)
+{
+    if (src == NULL || --src->refs > 0)
+        return;
+
+    for (int i = 0; i < src->nrows; i++)
+        row_release(src->rows[i]);
+    free(src->rows);
+    free(src);
+}
+
+// a row of text needs at most this many bytes, newline included
+size_t sel_row_max(const struct sel_source *src)
+{
+    return (size_t)src->cols * (1 + CLUSTER_MAX) * 4 + 1;
+}
+
+/* Turns rows of the selection into text, starting with row *row, as
+ * many as fit into room bytes (but at least one, room must be at least
+ * sel_row_max()). Returns the number of bytes written. */
+size_t sel_read(const struct sel_source *src, int *row, char *out,
+                size_t room)
+{
+    wchar_t *tmp = malloc(src->cols * (1 + CLUSTER_MAX) * sizeof(*tmp));
+    size_t   len = 0;
+
+    if (tmp == NULL) {
+        perror("malloc");
+        *row = src->nrows;
+        return 0;
+    }
+
+    for (; *row < src->nrows; ++*row) {
+        int    i    = *row;
+        int    x0   = src->block || i == 0 ? src->x0 : 0;
+        int    x1   = src->block || i == src->nrows - 1 ? src->x1
+                                                        : src->cols - 1;
+
+        if (len > 0 && room - len < sel_row_max(src))
+            break;
+
+        size_t n = row_glyphs(src->rows[i], x0, x1, tmp);
+        len += utf32_to_utf8(tmp, n, out + len);
+        if (i < src->nrows - 1)
+            out[len++] = '\n';
+    }
+
+    free(tmp);
+    return len;
+}
+
+// the next chunk of a transfer, false if we're out of memory
+bool sel_transfer_next(struct sel_transfer *tr)
+{
+    size_t room = SEL_CHUNK > sel_row_max(tr->src) ? SEL_CHUNK
+                                                   : sel_row_max(tr->src);
+
+    if (tr->chunk == NULL && (tr->chunk = malloc(room)) == NULL) {
+        perror("malloc");
+        return false;
+    }
+
+    tr->len  = sel_read(tr->src, &tr->row, tr->chunk, room);
+    tr->done = tr->row == tr->src->nrows;
+    return true;
+}
+
+void sel_transfer_free(size_t i)
+{
+    sel_source_unref(transfers[i]->src);
+    free(transfers[i]->chunk);
+    free(transfers[i]);
+    transfers[i] = transfers[--transfers_len];
+}
+
+bool our_window(Window w)
+{
+    for (size_t i = 0; i < tabs_len; i++)
+        if (tabs[i]->x11.termwin == w)
+            return true;
+    return false;
+}
+
+/* Puts the selection into property prop of the requestor's window.
+ * Whatever fits into one chunk goes there at once, the rest by INCR.
+ * Returns false if it can't be done. */
+bool sel_send(struct X11 *x11, struct sel_source *src, Window requestor,
+              Atom prop)
+{
+    struct sel_transfer *tr = calloc(1, sizeof(*tr));
+
+    if (tr == NULL) {
+        perror("calloc");
+        return false;
+    }
+
+    tr->requestor = requestor;
+    tr->property  = prop;
+    tr->src       = src;
+    tr->since     = monotonic_ms();
+    src->refs++;
+
+    if (!sel_transfer_next(tr)) {
+        sel_source_unref(src);
+        free(tr);
+        return false;
+    }
+
+    if (tr->done) {
+        XChangeProperty(x11->dpy, requestor, prop, x11->utf8_string, 8,
+                        PropModeReplace, (unsigned char *)tr->chunk,
+                        tr->len);
+        sel_source_unref(src);
+        free(tr->chunk);
+        free(tr);
+        return true;
+    }
+
+    // those that have been stuck for long, their requestors are gone
+    for (size_t i = 0; i < transfers_len; i++)
+        if (tr->since - transfers[i]->since > SEL_IDLE_MS)
+            sel_transfer_free(i--);
+
+    if (transfers_len == TRANSFERS_MAX) {
+        sel_source_unref(src);
+        free(tr->chunk);
+        free(tr);
+        return false;
+    }
+    transfers[transfers_len++] = tr;
+
+    // our own windows listen for that already
+    if (!our_window(requestor))
+        XSelectInput(x11->dpy, requestor, PropertyChangeMask);
+
+    long size = tr->len;  // a lower bound, all we know for now
+    XChangeProperty(x11->dpy, requestor, prop, x11->incr, 32,
+                    PropModeReplace, (unsigned char *)&size, 1);
+    return true;
+}
+
+void sel_request(struct X11 *x11, XSelectionRequestEvent *req)
+{
+    struct sel_source *src   = NULL;
+    Atom               prop  = req->property;
+    XSelectionEvent    reply = {
+        .type      = SelectionNotify,
+        .display   = x11->dpy,
+        .requestor = req->requestor,
+        .selection = req->selection,
+        .target    = req->target,
+        .property  = None,
+        .time      = req->time,
+    };
+
+    if (req->selection == XA_PRIMARY)
+        src = sel_primary;
+    else if (req->selection == x11->clipboard)
+        src = sel_clipboard;
+
+    // clients from before ICCCM don't say where they'd like it
+    if (prop == None)
+        prop = req->target;
+
+    if (src == NULL) {
+        // not ours (anymore)
+    }
+    else if (req->target == x11->targets) {
+        Atom targets[] = {x11->targets, x11->utf8_string, XA_STRING,
+                          x11->text};
+        XChangeProperty(x11->dpy, req->requestor, prop, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char *)targets,
+                        sizeof(targets) / sizeof(targets[0]));
+        reply.property = prop;
+    }
+    else if (req->target == x11->utf8_string || req->target == XA_STRING ||
+             req->target == x11->text) {
+        // UTF-8 either way, the way other terminals do it
+        if (sel_send(x11, src, req->requestor, prop))
+            reply.property = prop;
+    }
+
+    XSendEvent(x11->dpy, req->requestor, False, 0, (XEvent *)&reply);
+}
+
+// the requestor has taken the last chunk off a property, here's the next
+void sel_transfer_step(struct X11 *x11, XPropertyEvent *ev)
+{
+    for (size_t i = 0; i < transfers_len; i++) {
+        struct sel_transfer *tr = transfers[i];
+
+        if (tr->requestor != ev->window || tr->property != ev->atom)
+            continue;
+
+        XChangeProperty(x11->dpy, tr->requestor, tr->property,
+                        x11->utf8_string, 8, PropModeReplace,
+                        (unsigned char *)tr->chunk, tr->len);
+        tr->since = monotonic_ms();
+
+        if (tr->len == 0) {
+            if (!our_window(tr->requestor))
+                XSelectInput(x11->dpy, tr->requestor, NoEventMask);
+            sel_transfer_free(i);
+        }
+        else if (tr->done) {
+            tr->len = 0;  // the empty chunk at the end
+        }
+        else if (!sel_transfer_next(tr)) {
+            tr->len  = 0;  // cut it short
+            tr->done = true;
+        }
+        return;
+    }
+}
+
+/* Makes src (text on the screen of x11) the selection atom, PRIMARY or
+ * CLIPBOARD, and takes over our reference to it. For PRIMARY, there's
+ * only one selection on screen, the one in other windows of ours goes. */
+void sel_own(struct X11 *x11, Atom atom, struct sel_source *src, Time time)
+{
+    struct sel_source **slot = atom == XA_PRIMARY ? &sel_primary
+                                                  : &sel_clipboard;
+
+    if (src == NULL)
+        return;
+
+    XSetSelectionOwner(x11->dpy, atom, x11->termwin, time);
+    if (XGetSelectionOwner(x11->dpy, atom) != x11->termwin) {
+        sel_source_unref(src);
+        return;
+    }
+
+    sel_source_unref(*slot);
+    *slot = src;
+
+    if (atom != XA_PRIMARY)
+        return;
+
+    for (size_t i = 0; i < tabs_len; i++) {
+        struct X11 *other = &tabs[i]->x11;
+
+        if (other != x11 && other->sel_rows != NULL) {
+            sel_clear(other);
+            x11_redraw(other);
+        }
+    }
+}
+
+// someone else owns the selection now
+void sel_lost(XSelectionClearEvent *ev)
+{
+    struct sel_source **slot = ev->selection == XA_PRIMARY ? &sel_primary
+                                                           : &sel_clipboard;
+
+    if (*slot == NULL || (*slot)->owner != ev->window)
+        return;
+
+    sel_source_unref(*slot);
+    *slot = NULL;
+
+    if (ev->selection != XA_PRIMARY)
+        return;
+
+    for (size_t i = 0; i < tabs_len; i++) {
+        struct X11 *x11 = &tabs[i]->x11;
+
+        if (x11->termwin == ev->window && x11->sel_rows != NULL &&
+            !x11->sel_drag) {
+            sel_clear(x11);
+            x11_redraw(x11);
+        }
+    }
+}
+
+// a window is going away, and with it what it owns
+void sel_disown(Window w)
+{
+    struct sel_source **slots[] = {&sel_primary, &sel_clipboard};
+
+    for (size_t i = 0; i < sizeof(slots) / sizeof(slots[0]); i++) {
+        if (*slots[i] != NULL && (*slots[i])->owner == w) {
+            sel_source_unref(*slots[i]);
+            *slots[i] = NULL;
+        }
+    }
+}
+
+/* Queues pasted text for the shell, run() writes it once the pty takes
+ * it. Writing it all at once could block us: the shell echoes what it
+ * reads, and if we're stuck writing, nobody reads the echo. Newlines are
+ * sent as Enter would send them.
+ *
+ * Inside bracketed paste, the text mustn't contain ESC: a pasted
+ * "\33[201~" would end the paste early and have the rest run as if
+ * typed. Only the markers themselves (marker) keep theirs. */
+void paste_queue(struct tab *t, const char *buf, size_t n, bool marker)
+{
+    bool strip = t->x11.bracketed_paste && !marker;
+
+    if (t->paste_off == t->paste_len)
+        t->paste_off = t->paste_len = 0;
+
+    if (t->paste_len + n > t->paste_cap) {
+        size_t cap = t->paste_cap ? t->paste_cap : 4096;
+        while (cap < t->paste_len + n)
+            cap *= 2;
+
+        char *p = realloc(t->paste, cap);
+        if (p == NULL) {
+            perror("realloc");
+            return;
+        }
+        t->paste     = p;
+        t->paste_cap = cap;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (strip && buf[i] == '\33')
+            continue;
+        t->paste[t->paste_len++] = buf[i] == '\n' ? '\r' : buf[i];
+    }
+}
+
+// puts the bracketed paste markers around it, if the application wants
+void paste_bracket(struct tab *t, bool end)
+{
+    if (t->x11.bracketed_paste)
+        paste_queue(t, end ? "\33[201~" : "\33[200~", 6, true);
+}
+
+// asks the owner of selection (PRIMARY or CLIPBOARD) for its text
+void paste_request(struct tab *t, Atom selection, Time time)
+{
+    XConvertSelection(t->x11.dpy, selection, t->x11.utf8_string,
+                      t->x11.paste_prop, t->x11.termwin, time);
+}
+
+/* Takes what the selection owner has put into our window's property
+ * and queues it. That's either all of the text, the announcement of an
+ * INCR transfer, or one of its chunks; an empty one is the last. */
+void paste_read(struct tab *t)
+{
+    struct X11    *x11   = &t->x11;
+    bool           incr  = t->paste_incr;
+    bool           empty = true;
+    unsigned long  nitems, after, offset = 0;
+    unsigned char *data;
+    Atom           type;
+    int            format;
+
+    do {
+        if (XGetWindowProperty(x11->dpy, x11->termwin, x11->paste_prop,
+                               offset, SEL_CHUNK / 4, False,
+                               AnyPropertyType, &type, &format, &nitems,
+                               &after, &data) != Success)
+            return;
+
+        if (type == x11->incr) {
+            XFree(data);
+            t->paste_incr = true;
+            paste_bracket(t, false);
+            break;
+        }
+
+        if (offset == 0 && !incr)
+            paste_bracket(t, false);
+
+        if (format == 8 && nitems > 0) {
+            paste_queue(t, (char *)data, nitems, false);
+            empty = false;
+        }
+
+        offset += nitems / 4;
+        XFree(data);
+    } while (after > 0);
+
+    if (type != x11->incr && (!incr || empty)) {
+        t->paste_incr = false;
+        paste_bracket(t, true);
+    }
+
+    // for INCR, that's the owner's cue for the next chunk
+    XDeleteProperty(x11->dpy, x11->termwin, x11->paste_prop);
+}
+
+void sel_property(XPropertyEvent *ev)
+{
+    if (ev->state == PropertyDelete) {
+        sel_transfer_step(&x11_shared, ev);
+        return;
+    }
+
+    if (ev->atom != x11_shared.paste_prop)
+        return;
+
+    for (size_t i = 0; i < tabs_len; i++) {
+        if (tabs[i]->x11.termwin == ev->window && tabs[i]->paste_incr) {
+            paste_read(tabs[i]);
+            return;
+        }
+    }
+}
+
+/* The mouse, when the application doesn't take it. Returns true if the
+ * screen needs to be redrawn. */
+bool sel_mouse(struct tab *t, XEvent *ev)
+{
+    struct X11 *x11 = &t->x11;
+    int         x, y;
+
+    if (ev->type == MotionNotify) {
+        if (!x11->sel_drag)
+            return false;
+
+        x11_cell(x11, ev->xmotion.x, ev->xmotion.y, &x, &y);
+        if (x == x11->sel_bx && y == x11->sel_by)
+            return false;
+
+        x11->sel_bx = x;
+        x11->sel_by = y;
+        sel_update(x11);
+        return true;
+    }
+
+    if (ev->type == ButtonPress && ev->xbutton.button == Button2) {
+        paste_request(t, XA_PRIMARY, ev->xbutton.time);
+        return false;
+    }
+
+    if (ev->xbutton.button != Button1)
+        return false;
+
+    if (ev->type == ButtonRelease) {
+        if (!x11->sel_drag)
+            return false;
+        x11->sel_drag = false;
+        sel_own(x11, XA_PRIMARY, sel_selected(x11), ev->xbutton.time);
+        return false;
+    }
+
+    x11_cell(x11, ev->xbutton.x, ev->xbutton.y, &x, &y);
+
+    int clicks = 1;
+    if (ev->xbutton.time - x11->sel_time < DOUBLE_CLICK_MS &&
+        x == x11->sel_ax && y == x11->sel_ay)
+        clicks = x11->sel_clicks % 3 + 1;
+
+    sel_clear(x11);
+    x11->sel_time   = ev->xbutton.time;
+    x11->sel_clicks = clicks;
+    x11->sel_mode   = clicks == 1 ? SEL_CHAR : clicks == 2 ? SEL_WORD
+                                                           : SEL_LINE;
+    x11->sel_block  = ev->xbutton.state & Mod1Mask;
+    x11->sel_drag   = true;
+    x11->sel_ax     = x11->sel_bx = x;
+    x11->sel_ay     = x11->sel_by = y;
+
+    // a single click selects nothing until the pointer moves
+    if (clicks > 1)
+        sel_update(x11);
+
+    return true;
+}
+
+/* Opens the link under the pointer: runs open_cmd with /bin/sh -c, the
+ * URL or file name as $1 and, for a file, the line and the column (if
+ * there is one) as $2 and $3.
+ *
+ * File names are mostly relative to where the program that printed them
+ * runs, so that's where the command starts: the working directory of the
+ * job in the foreground of the shell, or of the shell itself. */
+void link_open(struct tab *t)
+{
+    struct X11  *x11 = &t->x11;
+    struct link *l   = &x11->hover;
+    char         cwd[64];
+    char        *text, *line = "", *column = "";
+    pid_t        pgrp;
+    int          n;
+
+    if (x11->hover_y == -1)
+        return;
+
+    n    = l->x1 - l->x0 + 1;
+    text = malloc(n + 1);
+    if (text == NULL) {
+        perror("malloc");
+        return;
+    }
+    for (int i = 0; i < n; i++)
+        text[i] = link_char(x11->rows[x11->hover_y]->cells + l->x0 + i);
+    text[n] = '\0';
+
+    if (l->colon != -1) {
+        text[l->colon - l->x0] = '\0';
+        line = text + l->colon - l->x0 + 1;
+        if ((column = strchr(line, ':')) != NULL)
+            *column++ = '\0';
+        else
+            column = "";
+    }
+
+    char *argv[] = {"/bin/sh", "-c", open_cmd, "eduterm", text, line, column,
+                    NULL};
+
+    pgrp = tcgetpgrp(t->pty.master);
+    snprintf(cwd, sizeof(cwd), "/proc/%d/cwd", (int)pgrp);
+    run_command(argv, pgrp > 0 ? cwd : NULL);
+    free(text);
+}
+
+// Ctrl+Shift+C, V and O, and Shift+Insert, false for other keys
+bool sel_key(struct tab *t, XKeyEvent *ev)
+{
+    struct X11  *x11  = &t->x11;
+    KeySym       ksym = XLookupKeysym(ev, 0);
+    unsigned int mods = ev->state & (ControlMask | ShiftMask);
+
+    if (mods == (ControlMask | ShiftMask) && ksym == XK_c) {
+        struct sel_source *src = sel_selected(x11);
+
+        if (src == NULL && x11->hover_y != -1)
+            src = sel_source_new(x11, x11->rows + x11->hover_y, 1,
+                                 x11->hover.x0, x11->hover.x1, false);
+        sel_own(x11, x11->clipboard, src, ev->time);
+        return true;
+    }
+
+    if (mods == (ControlMask | ShiftMask) && ksym == XK_o) {
+        link_open(t);
+        return true;
+    }
+
+    if (mods == (ControlMask | ShiftMask) && ksym == XK_v) {
+        paste_request(t, x11->clipboard, ev->time);
+        return true;
+    }
+
+    if (mods == ShiftMask && ksym == XK_Insert) {
+        paste_request(t, XA_PRIMARY, ev->time);
+        return true;
+    }
+
+    return false;
+}
+
+// the tab on screen in window w, tabs_len if there is none
+size_t tab_shown(Window w)
+{
+    size_t i;
+
+    for (i = 0; i < tabs_len; i++)
+        if (tabs[i]->x11.termwin == w && tabs[i]->x11.active)
+            break;
+
+    return i;
+}
+
+/* The tab after (dir > 0) or before (dir < 0) tab i in the same window,
+ * wrapping around. */
+size_t tab_next(size_t i, int dir)
+{
+    Window w = tabs[i]->x11.termwin;
+    size_t j = i;
+
+    do
+        j = (j + tabs_len + dir) % tabs_len;
+    while (tabs[j]->x11.termwin != w);
+
+    return j;
+}
+
+void tab_title(Window w)
+{
+    char   title[64];
+    size_t shown = tab_shown(w);
+    size_t n = 0, nth = 0;
+
+    for (size_t i = 0; i < tabs_len; i++) {
+        if (tabs[i]->x11.termwin != w)
+            continue;
+        if (i == shown)
+            nth = n;
+        n++;
+    }
+
+    if (n > 1)
+        snprintf(title, sizeof(title), "eduterm [%zu/%zu]", nth + 1, n);
+    else
+        snprintf(title, sizeof(title), "eduterm");
+
+    x11_set_title(&tabs[shown]->x11, title);
+    XFlush(x11_shared.dpy);
+}
+
+// puts tab i on screen, whatever was there before
+void tab_show(size_t i)
+{
+    struct X11 *x11 = &tabs[i]->x11;
+
+    x11->active = true;
+    x11->blink  = true;
+
+    // until the pointer moves, we don't know where it is
+    x11->pointer_y = -1;
+    x11->hover_y   = -1;
+
+    dirty_all_cells(x11);
+    x11_redraw(x11);
+    tab_title(x11->termwin);
+}
+
+void tab_switch(size_t i)
+{
+    size_t shown = tab_shown(tabs[i]->x11.termwin);
+
+    if (shown == i)
+        return;
+    if (shown < tabs_len)
+        tabs[shown]->x11.active = false;
+
+    tab_show(i);
+}
+
+/* Opens a tab with a new shell, starting in cwd (or ours if that's NULL).
+ * It goes into the same window as tab beside, or into a new window if
+ * that's NULL. Either way, it's not on screen yet. */
+struct tab *tab_open(struct tab *beside, const char *cwd)
+{
+    struct tab *t;
+
+    if (tabs_len >= tabs_cap) {
+        size_t       cap = tabs_cap ? tabs_cap * 2 : 8;
+        struct tab **n   = realloc(tabs, cap * sizeof(tabs[0]));
+
+        if (n == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        tabs     = n;
+        tabs_cap = cap;
+    }
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    t->x11        = beside != NULL ? beside->x11 : x11_shared;
+    t->x11.active = false;
+    if (!term_setup(&t->x11)) {
+        free(t);
+        return NULL;
+    }
+
+    if ((log_path != NULL && (t->log = log_open()) == NULL) ||
+        (triggers_len > 0 && (t->scan = trigger_scan_new()) == NULL) ||
+        !pt_pair(&t->pty) || !term_set_size(&t->pty, &t->x11) ||
+        !spawn(&t->pty, cwd)) {
+        if (t->log != NULL)
+            log_close(t->log);
+        if (t->scan != NULL)
+            trigger_scan_free(t->scan);
+        term_free(&t->x11);
+        free(t);
+        return NULL;
+    }
+
+    if (beside == NULL)
+        x11_window(&t->x11);
+
+    tabs[tabs_len++] = t;
+    return t;
+}
+
+/* Closes tab i. If it was the last one in its window, the window goes,
+ * too. */
+void tab_close(size_t i)
+{
+    struct tab *t     = tabs[i];
+    Window      w     = t->x11.termwin;
+    GC          gc    = t->x11.termgc;
+    bool        shown = t->x11.active;
+    size_t      next  = tabs_len - 1;
+
+    close(t->pty.master);
+    if (t->log != NULL)
+        log_close(t->log);
+    if (t->scan != NULL)
+        trigger_scan_free(t->scan);
+    export_close(t);
+    term_free(&t->x11);
+    free(t->paste);
+    free(t);
+
+    memmove(tabs + i, tabs + i + 1, (tabs_len - i - 1) * sizeof(tabs[0]));
+    tabs_len--;
+
+    // the neighbour to the right if there is one, else to the left
+    for (size_t j = 0; j < tabs_len; j++) {
+        if (tabs[j]->x11.termwin == w) {
+            next = j;
+            if (j >= i)
+                break;
+        }
+    }
+
+    if (next == tabs_len) {
+        sel_disown(w);
+        XFreeGC(x11_shared.dpy, gc);
+        XDestroyWindow(x11_shared.dpy, w);
+        XFlush(x11_shared.dpy);
+    }
+    else if (shown)
+        tab_show(next);
+    else
+        tab_title(w);
+}
+
+/* Xlib exit()s when the connection to the server is lost, the end of
+ * the logs mustn't get lost with it. */
+void tab_close_logs(void)
+{
+    for (size_t i = 0; i < tabs_len; i++) {
+        if (tabs[i]->log != NULL) {
+            log_close(tabs[i]->log);
+            tabs[i]->log = NULL;
+        }
+    }
+}
+
+void tab_close_window(Window w)
+{
+    // the one on screen goes last, so nothing gets redrawn on the way
+    for (size_t i = tabs_len; i-- > 0;)
+        if (tabs[i]->x11.termwin == w && !tabs[i]->x11.active)
+            tab_close(i);
+
+    size_t i = tab_shown(w);
+    if (i < tabs_len)
+        tab_close(i);
+}
+
+/* Ctrl+Shift+T opens a new tab, Ctrl+Shift+N a new window, Ctrl+PageUp
+ * and Ctrl+PageDown go to the previous and next tab. Returns false for
+ * all other keys, those belong to the shell. */
+bool tab_key(XKeyEvent *ev)
+{
+    KeySym       ksym = XLookupKeysym(ev, 0);
+    unsigned int mods = ev->state & (ControlMask | ShiftMask);
+    size_t       i    = tab_shown(ev->window);
+
+    if (mods == (ControlMask | ShiftMask) && ksym == XK_t) {
+        if (tab_open(tabs[i], NULL) != NULL)
+            tab_switch(tabs_len - 1);
+        return true;
+    }
+
+    if (mods == (ControlMask | ShiftMask) && ksym == XK_n) {
+        if (tab_open(NULL, NULL) != NULL)
+            tab_show(tabs_len - 1);
+        return true;
+    }
+
+    if (mods == ControlMask && ksym == XK_Prior) {
+        tab_switch(tab_next(i, -1));
+        return true;
+    }
+
+    if (mods == ControlMask && ksym == XK_Next) {
+        tab_switch(tab_next(i, 1));
+        return true;
+    }
+
+    return false;
+}
+
+void x11_event(XEvent *ev)
+{
+    Window w = ev->xany.window;
+    size_t i = tab_shown(w);
+
+    // may be about another client's window, see sel_send()
+    if (ev->type == PropertyNotify) {
+        sel_property(&ev->xproperty);
+        return;
+    }
+
+    // events for a window we've just closed
+    if (i == tabs_len)
+        return;
+
+    struct X11 *x11 = &tabs[i]->x11;
+
+    switch (ev->type) {
+      case Expose:
+        x11_expose(x11, &ev->xexpose);
+        if (ev->xexpose.count == 0)
+            x11_redraw(x11);
+        break;
+      case KeyPress:
+        x11->last_activity = monotonic_seconds();
+        if (!tab_key(&ev->xkey) && !sel_key(tabs[i], &ev->xkey))
+            x11_key(&ev->xkey, &tabs[i]->pty, x11);
+        break;
+      case LeaveNotify:
+        x11->pointer_y = -1;
+        link_hover(x11);
+        break;
+      case MotionNotify:
+        x11_motion_latest(x11->dpy, ev);
+        x11_cell(x11, ev->xmotion.x, ev->xmotion.y, &x11->pointer_x,
+                 &x11->pointer_y);
+        link_hover(x11);
+        /* fall through */
+      case ButtonPress:
+      case ButtonRelease:
+        if (ev->type == ButtonPress)
+            x11->last_activity = monotonic_seconds();
+        if (!x11_mouse(ev, &tabs[i]->pty, x11) && sel_mouse(tabs[i], ev))
+            x11_redraw(x11);
+        break;
+      case SelectionRequest:
+        sel_request(x11, &ev->xselectionrequest);
+        break;
+      case SelectionClear:
+        sel_lost(&ev->xselectionclear);
+        break;
+      case SelectionNotify:
+        if (ev->xselection.property != None) {
+            tabs[i]->paste_incr = false;
+            paste_read(tabs[i]);
+        }
+        break;
+      case FocusIn:
+      case FocusOut:
+        for (size_t j = 0; j < tabs_len; j++)
+            if (tabs[j]->x11.termwin == w)
+                tabs[j]->x11.focused = ev->type == FocusIn;
+        break;
+      case VisibilityNotify:
+        for (size_t j = 0; j < tabs_len; j++)
+            if (tabs[j]->x11.termwin == w)
+                tabs[j]->x11.visible =
+                    ev->xvisibility.state != VisibilityFullyObscured;
+        break;
+      case ClientMessage:
+        if ((Atom)ev->xclient.data.l[0] == x11->wm_delete_window)
+            tab_close_window(w);
+        break;
+    }
+}
+
+#define PARSE_SLICE 4096
+
+/* Handles the key presses waiting on the connection and leaves all other
+ * events queued. Keys can't close a tab, so this is safe in the middle of
+ * parsing. */
+void x11_keys(Display *dpy)
+{
+    XEvent ev;
+
+    if (dpy == NULL)  // replaying, there's nobody to press keys
+        return;
+
+    while (XCheckMaskEvent(dpy, KeyPressMask, &ev))
+        x11_event(&ev);
+}
+
+/* Feeds output of the tab's shell to its parser. Returns true if
+ * anything on the screen changed.
+ *
+ * After every PARSE_SLICE bytes, the key presses that came in meanwhile
+ * are handled. A flood of output can take a while to get through, and
+ * the user's Ctrl-C shouldn't have to wait for that. */
+bool tab_feed(struct tab *t, const char *_buf, size_t num)
+{
+    struct X11    *x11 = &t->x11;
+    struct PTY    *pty = &t->pty;
+    struct parser *p   = &t->parser;
+    char           buf[1];
+    wchar_t        glyphs[4096 + 1];
+    size_t         nglyphs;
+    bool           draw = false;
+
+    size_t start = 0;
+    if (!p->read_escape_mode && !p->read_charset && !p->read_csi &&
+        !p->read_osi && p->utf8.need == 0 && !print_child) {
+        start = jump_scroll(x11, pty, _buf, num, p->just_wrapped);
+        if (start > 0) {
+            p->just_wrapped = false;
+            draw            = true;
+        }
+    }
+
+    size_t slice_end = start + PARSE_SLICE;
+
+    for (size_t i = start; i < (size_t)num; i++) {
+        if (i >= slice_end) {
+            x11_keys(x11->dpy);
+            slice_end = i + PARSE_SLICE;
+        }
+
+        buf[0] = _buf[i];
+
+        if (!p->read_escape_mode && !p->read_charset && !p->read_csi &&
+            !p->read_osi) {
+            if (is_text_byte(buf[0])) {
+                /* Plain text: decode the whole run in one go
+                 * instead of going through the state machine
+                 * below for every single byte. */
+                size_t left = num - i;
+                size_t max  = sizeof(glyphs) / sizeof(glyphs[0]) - 1;
+                size_t used = utf8_decode(&p->utf8,
+                                          _buf + i,
+                                          left < max ? left : max,
+                                          glyphs,
+                                          &nglyphs);
+
+                if (print_child)
+                    for (size_t k = 0; k < used; k++)
+                        print_child_byte(_buf[i + k]);
+
+                for (size_t k = 0; k < nglyphs; k++)
+                    put_glyph(x11, glyphs[k], &p->just_wrapped);
+
+                draw = true;
+                i += used - 1;
+                continue;
+            }
+
+            // a control interrupted a multibyte sequence
+            if (utf8_flush(&p->utf8, glyphs)) {
+                put_glyph(x11, glyphs[0], &p->just_wrapped);
+                draw = true;
+            }
+        }
+
+        if (print_child)
+            print_child_byte(buf[0]);
+
+        if (p->read_escape_mode) {
+            p->read_escape_mode = false;
+            switch (buf[0]) {
+              case '[':
+                p->read_csi  = true;
+                csi_reset(&p->csi);
+                break;
+              case '=':
+                // Application Keypad
+                x11->application_keypad = true;
+                break;
+              case ']':
+                printf("OSI Start\n");
+                p->read_osi  = true;
+                p->osi_buf_i = 0;
+                break;
+              case '\\':
+                if (p->read_osi) {
+                    p->osi_buf[p->osi_buf_i] = '\0';
+                    process_osi(p->osi_buf, p->osi_buf_i, x11, pty);
+                    draw = true;
+                    p->read_osi = false;
+                }
+                break;
+              case '>': {  //  Normal Keypad (DECPNM)
+                x11->application_keypad = false;
+              } break;
+              case '(': {
+                //  ESC ( C   Designate G0 Character Set (ISO 2022)
+                p->read_charset = true;
+              } break;
+              case '7': {  // save cursor
+              } break;
+              case 'M': {
+                // move cursor up, if cursor at top, scroll screen
+                if (x11->buf_y==0) {
+                    // scroll window content down one row
+                    struct csi ri;
+                    csi_reset(&ri);
+                    ri.final = 'L';
+                    process_csi(&ri, x11, pty);
+                } else {
+                    // move cursor up
+                    --x11->buf_y;
+                }
+                draw = true;
+              } break;
+              default:
+                printf("Escape code unknown '%c' (%x)\n",
+                       (int)buf[0],
+                       (int)0xFF & buf[0]);
+                eexit(1);
+            }
+        }
+        else if (p->read_charset) {
+            p->read_charset = false;
+            switch (buf[0]) {
+              case '0':
+              case 'A':
+              case 'B':
+              case '4':
+              case 'C':
+              case '5':
+              case 'R':
+              case 'Q':
+              case 'K':
+              case 'Y':
+              case 'E':
+              case '6':
+              case 'Z':
+              case 'H':
+              case '7':
+              case '=': {
+              } break;
+            }
+        }
+        else if (p->read_csi) {
+            if (csi_feed(&p->csi, buf[0])) {
+                process_csi(&p->csi, x11, pty);
+                p->read_csi = false;
+                draw = true;
+                p->just_wrapped = false; 
+            }
+        }
+        else if (p->read_osi) {
+            p->osi_buf[p->osi_buf_i] = buf[0];
+            p->osi_buf_i++;
+            if (is_final_osi_byte(buf[0])) {
+                p->osi_buf[p->osi_buf_i-1] = '\0';
+                process_osi(p->osi_buf, p->osi_buf_i - 1, x11, pty);
+                p->read_osi = false;
+                draw = true;
+            }
+        }
+        else if (buf[0] == '\t') {
+            x11->buf_x += 8 - (x11->buf_x&7);
+            draw = true;
+        }
+        else if (buf[0] == '\r') {
+            /* "Carriage returns" are probably the most simple
+         * "terminal command": They just make the cursor jump
+         * back to the very first column. */
+            x11->buf_x = 0;
+            draw = true;
+        }
+        else if (buf[0] == (char)0x08) {
+            printf("Backspace\n");
+            draw = true;
+            if (x11->buf_x != 0)
+                x11->buf_x -= 1;
+        }
+        else if (buf[0] == (char)0x07) {
+            printf("Bell\n");
+        }
+        else if (buf[0] == (char)27) {
+            p->read_escape_mode = true;
+        }
+        else if (buf[0] == '\n') {
+            if (!p->just_wrapped) { 
+                p->add_newline = true; 
+                draw = true; 
+            } else {
+                printf("Supressed double newline\n");
+            }
+        } else {
+            // remaining C0 controls and DEL
+            put_glyph(x11, (unsigned char)buf[0], &p->just_wrapped);
+            draw = true;
+        }
+
+        if (p->add_newline) {
+            p->add_newline = false;
+            draw = true;
+            printf("Adding newline\n");
+            x11->buf_x = 0;
+            x11->buf_y++;
+
+            if (x11->buf_y > x11->scr_end) {
+                scroll_up(x11);
+                x11->buf_y = x11->scr_end;
+            }
+        }
+    }
+
+    return draw;
+}
+
+void trigger_run(struct trigger *tr, const char *line)
+{
+    char *argv[] = {"/bin/sh", "-c", tr->run, "eduterm", (char *)line, NULL};
+
+    run_command(argv, NULL);
+}
+
+// without a reader, or a reader that's behind, the line is dropped
+void trigger_fifo(struct trigger *tr, const char *line, size_t len)
+{
+    int fd = open(tr->fifo, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1)
+        return;
+
+    struct iovec iov[2] = {{(char *)line, len}, {"\n", 1}};
+    ssize_t      ignore = writev(fd, iov, 2);
+    (void)ignore;
+    close(fd);
+}
+
+void trigger_act(struct tab *t, struct trigger *tr)
+{
+    struct trigger_scan *sc = t->scan;
+
+    if (tr->bell && t->x11.dpy != NULL) {
+        XBell(t->x11.dpy, 0);
+        XFlush(t->x11.dpy);
+    }
+    if (tr->highlight)
+        sc->highlight = true;
+    if (tr->run != NULL)
+        trigger_run(tr, sc->line);
+    if (tr->fifo != NULL)
+        trigger_fifo(tr, sc->line, sc->line_len);
+}
+
+/* Fires the triggers that match the line so far and haven't yet. That's
+ * the literals the automaton saw, and the regular expressions that either
+ * had their literal seen or have none. */
+void trigger_fire(struct tab *t)
+{
+    struct trigger_scan *sc = t->scan;
+
+    sc->line[sc->line_len] = '\0';
+
+    for (size_t j = 0; j < ungated_len; j++) {
+        size_t i = ungated[j];
+        if (sc->mark[i] == 0 &&
+            regexec(&triggers[i].re, sc->line, 0, NULL, 0) == 0)
+            trigger_mark(sc, i, TRIGGER_SEEN);
+    }
+
+    for (size_t j = 0; j < sc->touched_len; j++) {
+        size_t          i  = sc->touched[j];
+        struct trigger *tr = &triggers[i];
+
+        if (sc->mark[i] & TRIGGER_FIRED)
+            continue;
+        if (tr->gated && regexec(&tr->re, sc->line, 0, NULL, 0) != 0)
+            continue;
+
+        sc->mark[i] |= TRIGGER_FIRED;
+        trigger_act(t, tr);
+    }
+}
+
+// gives the row the cursor is on the highlight color, all the way across
+void trigger_highlight(struct X11 *x11)
+{
+    struct row *r = row_mut(x11, x11->buf_y);
+
+    for (int x = 0; x < x11->buf_w; x++) {
+        r->cells[x].bg = x11->col_256[TRIGGER_HIGHLIGHT];
+        dirty(&r->cells[x]);
+    }
+}
+
+void trigger_line_done(struct trigger_scan *sc)
+{
+    for (size_t j = 0; j < sc->touched_len; j++)
+        sc->mark[sc->touched[j]] = 0;
+    sc->touched_len = 0;
+    sc->line_len    = 0;
+    sc->highlight   = false;
+    sc->row         = 0;
+}
+
+
+/* tab_feed() with the triggers looking on. Lines that a highlighting
+ * trigger matched are fed up to their end on their own, so that the
+ * cursor is still on them when they are highlighted. */
+bool trigger_feed(struct tab *t, const char *buf, size_t num)
+{
+    struct trigger_scan *sc    = t->scan;
+    unsigned             row   = sc->row;
+    int                  state = sc->text_state;
+    bool                 draw  = false;
+    size_t               fed   = 0;
+
+    for (size_t i = 0; i < num; i++) {
+        unsigned char b = buf[i];
+
+        // most of it is printable text, that doesn't need a closer look
+        if (state != TEXT_PLAIN || b < 0x20 || b == 0x7f) {
+            if (!text_keep(&state, b))
+                continue;
+
+            if (b == '\n') {
+                trigger_fire(t);
+                if (sc->highlight) {
+                    draw |= tab_feed(t, buf + fed, i - fed);
+                    fed = i;
+                    trigger_highlight(&t->x11);
+                }
+                trigger_line_done(sc);
+                row = 0;
+                continue;
+            }
+        }
+
+        unsigned next = ac.delta[row + ac.cls[b]];
+        row = next & ~AC_HIT;
+        if (sc->line_len < TRIGGER_LINE_MAX)
+            sc->line[sc->line_len++] = b;
+        if (next & AC_HIT)
+            trigger_seen(sc, row / ac.nclasses);
+    }
+    sc->row        = row;
+    sc->text_state = state;
+
+    // what there is of the line so far, it may be a prompt waiting
+    if (sc->line_len > 0)
+        trigger_fire(t);
+
+    return tab_feed(t, buf + fed, num - fed) || draw;
+}
+
+/* Daemon mode: one process keeps the display connection, the fonts and
+ * the colors around, and "eduterm --client" asks it for new windows over
+ * a Unix socket. The client sends the directory the shell should start
+ * in, NUL-terminated, and gets back a single byte: 0 if the window is
+ * open, 1 if not.
+ *
+ * There's one daemon per user and display. $XDG_RUNTIME_DIR belongs to
+ * the user alone, /tmp is only the fallback. */
+bool socket_path(struct sockaddr_un *addr)
+{
+    const char *dir     = getenv("XDG_RUNTIME_DIR");
+    const char *display = getenv("DISPLAY");
+    int         n;
+
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+    if (display == NULL)
+        display = "";
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/eduterm-%u-%s",
+                 dir, (unsigned int)getuid(), display);
+    if (n < 0 || (size_t)n >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return false;
+    }
+
+    // $DISPLAY may be a path itself
+    for (char *c = addr->sun_path + strlen(dir) + 1; *c != '\0'; c++)
+        if (*c == '/')
+            *c = '_';
+
+    return true;
+}
+
+int daemon_connect(void)
+{
+    struct sockaddr_un addr;
+    int                fd;
+
+    if (!socket_path(&addr))
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int daemon_listen(void)
+{
+    struct sockaddr_un addr;
+    mode_t             mask;
+    int                fd;
+
+    if (!socket_path(&addr))
+        return -1;
+
+    // only a socket nobody answers on is left over and may go
+    fd = daemon_connect();
+    if (fd != -1) {
+        fprintf(stderr, "Daemon already running on %s\n", addr.sun_path);
+        close(fd);
+        return -1;
+    }
+    unlink(addr.sun_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    mask = umask(077);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        umask(mask);
+        close(fd);
+        return -1;
+    }
+    umask(mask);
+
+    if (listen(fd, 16) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+
+    printf("Daemon listening on %s\n", addr.sun_path);
+    return fd;
+}
+
+#define DAEMON_CLIENTS 16  // --clients still saying where, at a time
+
+/* A --client that has connected and is sending the directory to start
+ * its shell in. That's read as it comes in, by run()'s select() loop,
+ * so a client that never finishes can't stall us; it only takes a slot
+ * until a newer client needs one. */
+struct daemon_client {
+    int    fd;
+    char   cwd[4096];
+    size_t len;
+};
+
+static struct daemon_client *daemon_clients[DAEMON_CLIENTS];
+static size_t                daemon_clients_len;
+
+// answers client i (status 0 for a window opened) and lets go of it
+void daemon_close(size_t i, char status)
+{
+    send(daemon_clients[i]->fd, &status, 1, MSG_NOSIGNAL);
+    close(daemon_clients[i]->fd);
+    free(daemon_clients[i]);
+
+    // keep them in order, the oldest goes first when we run out
+    memmove(daemon_clients + i, daemon_clients + i + 1,
+            (--daemon_clients_len - i) * sizeof(daemon_clients[0]));
+}
+
+void daemon_accept(int listen_fd)
+{
+    struct daemon_client *c;
+    int                   fd;
+
+    // the shell must not inherit this one
+    fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd == -1) {
+        perror("accept");
+        return;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        perror("calloc");
+        close(fd);
+        return;
+    }
+
+    if (daemon_clients_len == DAEMON_CLIENTS)
+        daemon_close(0, 1);
+
+    c->fd                                = fd;
+    daemon_clients[daemon_clients_len++] = c;
+}
+
+/* Reads what there is from client i. Once the directory is complete (or
+ * can't be anymore), opens the window and answers. Returns false if the
+ * client is gone after that. */
+bool daemon_read(size_t i)
+{
+    struct daemon_client *c = daemon_clients[i];
+    char                  status = 1;
+    ssize_t               n = read(c->fd, c->cwd + c->len,
+                                   sizeof(c->cwd) - c->len);
+
+    if (n == -1 && errno == EAGAIN)
+        return true;
+
+    if (n > 0) {
+        c->len += n;
+        if (memchr(c->cwd + c->len - n, '\0', n) == NULL &&
+            c->len < sizeof(c->cwd))
+            return true;
+    }
+
+    if (memchr(c->cwd, '\0', c->len) != NULL &&
+        tab_open(NULL, c->cwd[0] != '\0' ? c->cwd : NULL) != NULL) {
+        tab_show(tabs_len - 1);
+        status = 0;
+    }
+
+    daemon_close(i, status);
+    return false;
+}
+
+int client(void)
+{
+    char cwd[4096];
+    char status = 1;
+    int  fd     = daemon_connect();
+
+    if (fd == -1) {
+        fprintf(stderr, "No daemon running, start one with --daemon\n");
+        return 1;
+    }
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = '\0';
+
+    if (send(fd, cwd, strlen(cwd) + 1, MSG_NOSIGNAL) == -1 ||
+        read(fd, &status, 1) != 1) {
+        fprintf(stderr, "Daemon did not answer\n");
+        status = 1;
+    }
+
+    close(fd);
+    return status;
+}
+
+/* The control socket (--control PATH), for scripts that drive a terminal
+ * and look at what's on it, tests of command line tools for instance. A
+ * client sends commands, a line each, and gets a line back for each,
+ * starting with "ok" or "error":
+ *
+ *     tab N               the commands after this go to tab N (counting
+ *                         from 0, in the order they were opened), the
+ *                         first one is the default
+ *     send-keys TEXT      types TEXT, with \n, \r, \t, \e, \a, \b, \\ and
+ *                         \xHH escapes
+ *     resize COLSxROWS    resizes the tab along with its window and the
+ *                         other tabs in it
+ *     cursor              "ok X Y", counting from 0
+ *     screen              "ok ROWS", then the rows as text, a line each
+ *     wait-for-text MS TEXT
+ *                         "ok" once TEXT is on the screen (within a row),
+ *                         "error timeout" if it isn't after MS ms; the
+ *                         commands after it wait, too
+ *     export              "ok SIZE", with a read-only file descriptor for
+ *                         the screen export (see struct screen_export)
+ *                         in the same message (SCM_RIGHTS)
+ *
+ * Shells learn the path from $EDUTERM_CONTROL. */
+
+#define CONTROL_MAX 16  // clients at a time
+
+struct control {
+    int    fd;
+    char   buf[4096];
+    size_t len;
+    size_t tab;
+    char  *wait_text;   // while waiting for it to show up
+    long   wait_until;  // monotonic_ms()
+    bool   gone;        // hung up, or didn't take its replies
+};
+
+static int             control_fd = -1;
+static struct control *controls[CONTROL_MAX];
+static size_t          controls_len;
+
+int control_listen(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat        st;
+    mode_t             mask;
+    int                fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    /* Only a socket that's left over from before, one nobody answers on,
+     * may go. Not a file that happens to be there, and not the socket of
+     * another eduterm. */
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s exists and is no socket\n", path);
+            return -1;
+        }
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            perror("socket");
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "%s is in use\n", path);
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    mask = umask(077);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        umask(mask);
+        close(fd);
+        return -1;
+    }
+    umask(mask);
+
+    if (listen(fd, CONTROL_MAX) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void control_close(size_t i)
+{
+    close(controls[i]->fd);
+    free(controls[i]->wait_text);
+    free(controls[i]);
+    controls[i] = controls[--controls_len];
+}
+
+void control_accept(void)
+{
+    struct control *c;
+    int             fd = accept4(control_fd, NULL, NULL,
+                                 SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+    if (fd == -1)
+        return;
+
+    if (controls_len >= CONTROL_MAX || (c = calloc(1, sizeof(*c))) == NULL) {
+        close(fd);
+        return;
+    }
+
+    c->fd                    = fd;
+    controls[controls_len++] = c;
+}
+
+/* Sends a reply, and the file descriptor fd along with it unless it's
+ * -1. A client that doesn't read its replies doesn't get to stall us,
+ * it's cut off. */
+void control_send(struct control *c, const char *msg, size_t len, int fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+    struct iovec  iov = {(char *)msg, len};
+    struct msghdr mh  = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (fd != -1) {
+        mh.msg_control    = cmsg.buf;
+        mh.msg_controllen = sizeof(cmsg.buf);
+
+        struct cmsghdr *ch = CMSG_FIRSTHDR(&mh);
+        ch->cmsg_level     = SOL_SOCKET;
+        ch->cmsg_type      = SCM_RIGHTS;
+        ch->cmsg_len       = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(ch), &fd, sizeof(int));
+    }
+
+    while (len > 0 && !c->gone) {
+        ssize_t n = sendmsg(c->fd, &mh, MSG_NOSIGNAL);
+        if (n <= 0) {
+            c->gone = true;
+            break;
+        }
+
+        iov.iov_base      = (char *)iov.iov_base + n;
+        iov.iov_len       = len -= n;
+        mh.msg_control    = NULL;
+        mh.msg_controllen = 0;
+    }
+}
+
+void control_reply(struct control *c, const char *fmt, ...)
+{
+    char    msg[256];
+    va_list ap;
+    int     n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(msg, sizeof(msg) - 1, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t)n >= sizeof(msg) - 1)
+        n = sizeof(msg) - 2;
+    msg[n++] = '\n';
+
+    control_send(c, msg, n, -1);
+}
+
+/* Row y of the screen as UTF-8, out needs room for buf_w * 32 bytes and
+ * tmp for buf_w * (1 + CLUSTER_MAX) code points. */
+size_t row_text(struct X11 *x11, int y, wchar_t *tmp, char *out)
+{
+    size_t n = row_glyphs(x11->rows[y], 0, x11->buf_w - 1, tmp);
+    return utf32_to_utf8(tmp, n, out);
+}
+
+bool screen_has(struct X11 *x11, const char *text)
+{
+    char    *row   = malloc(x11->buf_w * 32 + 1);
+    wchar_t *tmp   = malloc(x11->buf_w * (1 + CLUSTER_MAX) * sizeof(*tmp));
+    bool     found = false;
+
+    for (int y = 0; y < x11->buf_h && !found && row && tmp; y++) {
+        row[row_text(x11, y, tmp, row)] = '\0';
+        found = strstr(row, text) != NULL;
+    }
+
+    free(row);
+    free(tmp);
+    return found;
+}
+
+// resolves the escapes of send-keys in place, returns the new length
+size_t unescape(char *s)
+{
+    size_t out = 0;
+
+    for (char *p = s; *p != '\0'; p++) {
+        if (*p != '\\' || p[1] == '\0') {
+            s[out++] = *p;
+            continue;
+        }
+
+        switch (*++p) {
+          case 'n':  s[out++] = '\n';   break;
+          case 'r':  s[out++] = '\r';   break;
+          case 't':  s[out++] = '\t';   break;
+          case 'e':  s[out++] = '\033'; break;
+          case 'a':  s[out++] = '\a';   break;
+          case 'b':  s[out++] = '\b';   break;
+          case 'x': {
+            char hex[3] = {0};
+            if (isxdigit((unsigned char)p[1])) {
+                hex[0] = *++p;
+                if (isxdigit((unsigned char)p[1]))
+                    hex[1] = *++p;
+                s[out++] = strtol(hex, NULL, 16);
+            }
+            else {
+                s[out++] = 'x';
+            }
+          } break;
+          default:   s[out++] = *p;     break;
+        }
+    }
 
-        for (struct cell *dest   = lstart,
-                         *source = dest + x11->buf_w * arg1;
-             source < x11->buf + x11->buf_w * (1+x11->scr_end);
-             ++source, ++dest)
-            copy(dest, source);
+    return out;
+}
 
-        for (struct cell *dest = x11->buf + x11->buf_w * (1+x11->scr_end - arg1);
-             dest < x11->buf + x11->buf_w * (1+x11->scr_end);
-             ++dest)
-            clear(x11, dest);
-      } break;
-      case 'L': {
-        int arg1 = 1;
-        sscanf(buf, "%dL", &arg1);
-        // insert arg1 lines
-        printf("Insert %d lines\n", arg1);
-        struct cell *scroll_end = x11->buf + (x11->scr_end + 1) * x11->buf_w;
+// resizes every tab in window w, the window itself and the shells
+void control_resize(Window w, int cols, int rows)
+{
+    for (size_t i = 0; i < tabs_len; i++) {
+        struct tab *t = tabs[i];
+
+        if (t->x11.termwin != w)
+            continue;
+
+        export_close(t);
+        term_resize(&t->x11, cols, rows);
+        term_set_size(&t->pty, &t->x11);
+        if (t->x11.active) {
+            XResizeWindow(t->x11.dpy, w, t->x11.w, t->x11.h);
+            x11_redraw(&t->x11);
+        }
+    }
+}
 
-        for (struct cell *dest   = scroll_end,
-                         *source = scroll_end - x11->buf_w * arg1;
-             source >= lstart;
-             --source, --dest)
-            copy(dest, source);
+void control_command(struct control *c, char *line)
+{
+    char *arg = line + strcspn(line, " ");
+    int   a, b;
+    char  x;
 
-        for (struct cell *dest = lstart, *end = lstart + x11->buf_w * arg1;
-             dest < end;
-             ++dest) 
-            clear(x11, dest);
+    if (*arg != '\0')
+        *arg++ = '\0';
 
-      } break;
-      case 'n': {
-        // Device Status Report
-        int arg = atoi(buf);
-        if (arg == 6) {
-          char command[20];
-          size_t len;
+    if (strcmp(line, "tab") == 0) {
+        c->tab = strtoul(arg, NULL, 10);
+        control_reply(c, c->tab < tabs_len ? "ok" : "error no such tab");
+        return;
+    }
 
-          len = snprintf(command,
-                         sizeof(command),
-                         "\e[%d;%dR",
-                         x11->buf_x + 1,
-                         x11->buf_y + 1);
+    if (c->tab >= tabs_len) {
+        control_reply(c, "error no such tab");
+        return;
+    }
 
-          int writ = write(pty->master, command, len);
-          (void) writ;
+    struct tab *t = tabs[c->tab];
+
+    if (strcmp(line, "send-keys") == 0) {
+        size_t len    = unescape(arg);
+        int    ignore = write(t->pty.master, arg, len);
+        (void)ignore;
+        control_reply(c, "ok");
+    }
+    else if (strcmp(line, "resize") == 0) {
+        if (sscanf(arg, "%d%c%d", &a, &x, &b) != 3 || x != 'x' || a < 1 ||
+            b < 1 || a > CSI_MAX_VALUE || b > CSI_MAX_VALUE) {
+            control_reply(c, "error invalid size");
+            return;
+        }
+        control_resize(t->x11.termwin, a, b);
+        control_reply(c, "ok");
+    }
+    else if (strcmp(line, "cursor") == 0) {
+        control_reply(c, "ok %d %d", t->x11.buf_x, t->x11.buf_y);
+    }
+    else if (strcmp(line, "screen") == 0) {
+        char    *text = malloc(t->x11.buf_h * (t->x11.buf_w * 32 + 1));
+        wchar_t *tmp  = malloc(t->x11.buf_w * (1 + CLUSTER_MAX) *
+                               sizeof(*tmp));
+        char     head[32];
+        size_t   len = 0;
+
+        if (text == NULL || tmp == NULL) {
+            free(text);
+            free(tmp);
+            control_reply(c, "error out of memory");
+            return;
+        }
+        for (int y = 0; y < t->x11.buf_h; y++) {
+            len += row_text(&t->x11, y, tmp, text + len);
+            text[len++] = '\n';
         }
-        else if (arg == 5) {
-          char command[20];
-          size_t len;
 
-          len = snprintf(command,
-                         sizeof(command),
-                         "\e[0n");
+        int n = snprintf(head, sizeof(head), "ok %d\n", t->x11.buf_h);
+        control_send(c, head, n, -1);
+        control_send(c, text, len, -1);
+        free(text);
+        free(tmp);
+    }
+    else if (strcmp(line, "wait-for-text") == 0) {
+        char *text;
+        long  ms = strtol(arg, &text, 10);
 
-          int writ = write(pty->master, command, len);
-          (void) writ;
+        if (text == arg || *text != ' ' || ms < 0) {
+            control_reply(c, "error usage: wait-for-text MS TEXT");
+            return;
         }
-        else {
-            eexit(1);
+        c->wait_text  = strdup(text + 1);
+        c->wait_until = monotonic_ms() + ms;
+    }
+    else if (strcmp(line, "export") == 0) {
+        char msg[32];
+        int  fd = export_open(t);
+
+        if (fd == -1) {
+            control_reply(c, "error no export");
+            return;
         }
-      } break;
-      case 't': {
-        // IGNORE
-        // Window manipulation (from dtterm, as well as extensions). These controls 
-        //      may be disabled using the allowWindowOps resource. Valid values for 
-        //      the first (and any additional parameters) are:
-      } break;      	
-      default: {
-        eexit(1);
-      } break;
+        int n = snprintf(msg, sizeof(msg), "ok %zu\n", export_size(&t->x11));
+        control_send(c, msg, n, fd);
+        close(fd);
+    }
+    else {
+        control_reply(c, "error unknown command '%s'", line);
     }
 }
 
-void process_osi(char *buf, size_t len, struct X11 *x11, struct PTY *pty)
+// the commands that have come in, unless the client is waiting
+void control_process(struct control *c)
 {
-    (void)len;
-    (void)x11;
-    (void)pty;
+    char *nl;
 
-    for(char*a = buf; *a!= 0;++a) if(!isprint(*a)) *a = '?';
+    while (c->wait_text == NULL && !c->gone &&
+           (nl = memchr(c->buf, '\n', c->len)) != NULL) {
+        *nl = '\0';
+        if (nl > c->buf && nl[-1] == '\r')
+            nl[-1] = '\0';
 
-    printf("Osi received '%s'\n", buf);
+        control_command(c, c->buf);
+
+        c->len -= nl + 1 - c->buf;
+        memmove(c->buf, nl + 1, c->len);
+    }
 }
 
-void scroll_up(struct X11 *x11)
+void control_read(struct control *c)
 {
-    size_t w = x11->buf_w;
-    for (struct cell *dest   = x11->buf + (w * x11->scr_begin),
-                     *source = dest + w;
-         source < x11->buf + w * (x11->scr_end + 1);
-         ++source, ++dest)
-        copy(dest, source);
+    ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+
+    if (n == -1 && errno == EAGAIN)
+        return;
+    if (n <= 0) {
+        c->gone = true;
+        return;
+    }
+
+    c->len += n;
+    control_process(c);
 
-    for (struct cell *dest = x11->buf + w * (x11->scr_end);
-         dest < x11->buf + w * (x11->scr_end + 1);
-         ++dest)
-        clear(x11, dest);
+    // a line that long is no command
+    if (c->len == sizeof(c->buf))
+        c->gone = true;
 }
 
-int run(struct PTY *pty, struct X11 *x11)
+/* Lets go of the clients that are gone and answers those whose text
+ * showed up or whose time is up. Returns how long until the next one is
+ * up, -1 if nobody's waiting. */
+long control_poll(void)
 {
-    int    maxfd;
-    fd_set active;
-    fd_set readable;
-    XEvent ev;
-    char   _buf[4096];
-    char   buf[1];
-    bool   just_wrapped     = false;
-    bool   add_newline      = false;
-    bool   read_escape_mode = false;
-    bool   read_csi         = false;
-    bool   read_osi         = false;
-    bool   read_charset     = false;
-    bool   read_utf8        = false;
-
-    char   csi_buf[20];
-    size_t csi_buf_i = 0;
+    long now = monotonic_ms(), left = -1;
 
-    char   osi_buf[200];
-    size_t osi_buf_i = 0;
+    for (size_t i = 0; i < controls_len; i++) {
+        struct control *c = controls[i];
 
-    size_t utf8_size = 0; 
-    char utf8_buf[4];
-    size_t utf8_idx = 0;
+        if (c->gone) {
+            control_close(i--);
+            continue;
+        }
 
-    struct timeval timeout;
+        if (c->wait_text == NULL)
+            continue;
 
-    bool draw = false;
+        bool found = c->tab < tabs_len &&
+                     screen_has(&tabs[c->tab]->x11, c->wait_text);
 
-    maxfd = pty->master > x11->fd ? pty->master : x11->fd;
+        if (found || now >= c->wait_until) {
+            free(c->wait_text);
+            c->wait_text = NULL;
+            control_reply(c, found ? "ok" : "error timeout");
+            control_process(c);
+            i--;  // it may be waiting again, or gone
+            continue;
+        }
+
+        if (left == -1 || c->wait_until - now < left)
+            left = c->wait_until - now;
+    }
+
+    return left;
+}
+
+/* listen_fd is the daemon's socket, -1 if we're not one. Without it, we
+ * are done once the last window is closed. */
+int run(int listen_fd)
+{
+    Display *dpy = x11_shared.dpy;
+    int      maxfd;
+    fd_set   readable, writable;
+    XEvent   ev;
+    char     _buf[65536];
+    bool     stdin_open = true;
 
-    FD_ZERO(&active);
-    FD_SET(pty->master, &active);
-    FD_SET(x11->fd, &active);
-    FD_SET(0, &active);
+    struct timeval timeout;
 
     for (;;) {
-        readable = active;
+        long wait_left = control_poll();
 
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 1000000;
+        FD_ZERO(&readable);
+        FD_SET(x11_shared.fd, &readable);
+        maxfd = x11_shared.fd;
 
-        int num = select(maxfd + 1, &readable, NULL, NULL, &timeout);
-        if (num == 0) {
-            x11->blink = !x11->blink;
-            x11_redraw(x11);
-                // static int col_n = 0; x11->col_bg = x11->col_os[++col_n %
-                // col_os_length]; printf("Timeout %lu %d\n", x11->col_bg,
-                // col_n);
-            continue;
+        if (stdin_open)
+            FD_SET(0, &readable);
+
+        if (listen_fd != -1) {
+            FD_SET(listen_fd, &readable);
+            if (listen_fd > maxfd)
+                maxfd = listen_fd;
         }
-        else if (num == -1) {
-            perror("select");
-            return 1;
+
+        for (size_t i = 0; i < daemon_clients_len; i++) {
+            FD_SET(daemon_clients[i]->fd, &readable);
+            if (daemon_clients[i]->fd > maxfd)
+                maxfd = daemon_clients[i]->fd;
         }
 
-        if (FD_ISSET(pty->master, &readable)) {
-            ssize_t num = read(pty->master, _buf, sizeof(_buf));
+        FD_ZERO(&writable);
+        for (size_t i = 0; i < tabs_len; i++) {
+            FD_SET(tabs[i]->pty.master, &readable);
+            if (tabs[i]->pty.master > maxfd)
+                maxfd = tabs[i]->pty.master;
 
-            if (num == -1) {
-                break;
-            }
+            if (tabs[i]->paste_off < tabs[i]->paste_len)
+                FD_SET(tabs[i]->pty.master, &writable);
+        }
 
-            for (size_t i = 0; i < (size_t)num; i++) {
-                buf[0] = _buf[i];
+        if (control_fd != -1) {
+            FD_SET(control_fd, &readable);
+            if (control_fd > maxfd)
+                maxfd = control_fd;
+        }
 
-                if (print_child) { 
-                    char printbuf[2];
+        for (size_t i = 0; i < controls_len; i++) {
+            FD_SET(controls[i]->fd, &readable);
+            if (controls[i]->fd > maxfd)
+                maxfd = controls[i]->fd;
+        }
 
-                    if (buf[0] >= 32 && buf[0] <= 126)
-                        printbuf[0] = buf[0];
-                    else
-                        printbuf[0] = '?';
+        // only tabs on screen draw, so only they sync or blink
+        bool blinking  = false;
+        bool syncing   = false;
+        long sync_left = SYNC_TIMEOUT_MS;
 
-                    printbuf[1] = '\0';
-                    printf("Child sent '%s' (%d) (0x%x)\n",
-                           printbuf,
-                           (int)buf[0],
-                           (unsigned char)buf[0]);
-                }
+        for (size_t i = 0; i < tabs_len; i++) {
+            struct X11 *x11 = &tabs[i]->x11;
 
-                if (read_escape_mode) {
-                    read_escape_mode = false;
-                    switch (buf[0]) {
-                      case '[':
-                        read_csi  = true;
-                        csi_buf_i = 0;
-                        break;
-                      case '=':
-                        // Application Keypad
-                        x11->application_keypad = true;
-                        break;
-                      case ']':
-                        printf("OSI Start\n");
-                        read_osi  = true;
-                        osi_buf_i = 0;
-                        break;
-                      case '\\':
-                        if (read_osi) {
-                            osi_buf[osi_buf_i] = '\0';
-                            process_osi(osi_buf, osi_buf_i, x11, pty);
-                            draw = true;
-                            read_osi = false;
-                        }
-                        break;
-                      case '>': {  //  Normal Keypad (DECPNM)
-                        x11->application_keypad = false;
-                      } break;
-                      case '(': {
-                        //  ESC ( C   Designate G0 Character Set (ISO 2022)
-                        read_charset = true;
-                      } break;
-                      case '7': {  // save cursor
-                      } break;
-                      case 'M': {
-                        // move cursor up, if cursor at top, scroll screen
-                        if (x11->buf_y==0) {
-                            // scroll window content down one row
-                            process_csi("L", 0, x11, pty);
-                        } else {
-                            // move cursor up
-                            --x11->buf_y;
-                        }
-                        draw = true;
-                      } break;
-                      default:
-                        printf("Escape code unknown '%c' (%x)\n",
-                               (int)buf[0],
-                               (int)0xFF & buf[0]);
-                        eexit(1);
-                    }
-                }
-                else if (read_charset) {
-                    read_charset = false;
-                    switch (buf[0]) {
-                      case '0':
-                      case 'A':
-                      case 'B':
-                      case '4':
-                      case 'C':
-                      case '5':
-                      case 'R':
-                      case 'Q':
-                      case 'K':
-                      case 'Y':
-                      case 'E':
-                      case '6':
-                      case 'Z':
-                      case 'H':
-                      case '7':
-                      case '=': {
-                      } break;
-                    }
-                }
-                else if (read_csi) {
-                    csi_buf[csi_buf_i] = buf[0];
-                    csi_buf_i++;
-                    if (is_final_csi_byte(buf[0])) {
-                        csi_buf[csi_buf_i] = '\0';
-                        process_csi(csi_buf, csi_buf_i - 1, x11, pty);
-                        read_csi = false;
-                        draw = true;
-                        just_wrapped = false; 
-                    }
-                }
-                else if (read_osi) {
-                    osi_buf[osi_buf_i] = buf[0];
-                    osi_buf_i++;
-                    if (is_final_osi_byte(buf[0])) {
-                        osi_buf[osi_buf_i-1] = '\0';
-                        process_osi(osi_buf, osi_buf_i - 1, x11, pty);
-                        read_osi = false;
-                        draw = true;
-                    }
-                }
-                else if (buf[0] == '\t') {
-                    x11->buf_x += 8 - (x11->buf_x&7);
-                    draw = true;
-                }
-                else if (buf[0] == '\r') {
-                    /* "Carriage returns" are probably the most simple
-                 * "terminal command": They just make the cursor jump
-                 * back to the very first column. */
-                    x11->buf_x = 0;
-                    draw = true;
-                }
-                else if (buf[0] == (char)0x08) {
-                    printf("Backspace\n");
-                    draw = true;
-                    if (x11->buf_x != 0)
-                        x11->buf_x -= 1;
-                }
-                else if (buf[0] == (char)0x07) {
-                    printf("Bell\n");
+            if (!x11->active)
+                continue;
+
+            if (x11->sync_update) {
+                long left = SYNC_TIMEOUT_MS -
+                            (monotonic_ms() - x11->sync_since);
+                if (left <= 0) {
+                    printf("Synchronized update timed out\n");
+                    x11->sync_update = false;
+                    export_update(tabs[i]);
+                    x11_redraw(x11);
                 }
-                else if (buf[0] == (char)27) {
-                    read_escape_mode = true;
+                else {
+                    syncing   = true;
+                    sync_left = left < sync_left ? left : sync_left;
                 }
-                else if (buf[0] == '\n') {
-                    if (!just_wrapped) { 
-                        add_newline = true; 
-                        draw = true; 
-                    } else {
-                        printf("Supressed double newline\n");
-                    }
-                } else if ( !read_utf8 && (buf[0] & 0x80) != 0) {
-                    utf8_idx = 0;
-                    read_utf8 = true;
-                    utf8_size = 0;
-
-                    // utf8 character
-                    if ((buf[0] & 0xE0) == 0xC0)
-                        utf8_size = 2;
-                    else if ((buf[0] & 0xF0) == 0xE0)
-                        utf8_size = 3;
-                    else if ((buf[0] & 0xF8) == 0xF0)
-                        utf8_size = 4;
-                    else { eexit(1); }
-
-                    utf8_buf[utf8_idx++] = buf[0];
-                } else if (read_utf8 && utf8_idx < utf8_size-1) {
-                    utf8_buf[utf8_idx++] = buf[0];
-                } else {
-                    wchar_t glyph = buf[0];
-
-                    if (read_utf8) {
-                        utf8_buf[utf8_idx++] = buf[0];
-                        read_utf8 = false;
-                        glyph = utf8_to_utf32(utf8_buf, utf8_size);
-                    }
+            }
 
-                    if (just_wrapped) {
-                        just_wrapped = false;
-                        x11->buf_x   = 0;
-                        if (x11->buf_y > x11->scr_end) {
-                            scroll_up(x11);
-                            x11->buf_y = x11->scr_end;
-                        } else {
-                            ++x11->buf_y;
-                        }
-                    }
+            if (x11_cursor_blinks(x11)) {
+                blinking = true;
+            }
+            else if (!x11->blink) {
+                // don't leave the cursor behind in its "off" phase
+                x11->blink = true;
+                x11_draw_cursor(x11);
+            }
+        }
 
-                    read_utf8 = false;
-                    putch(x11, glyph);
-                    draw = true;
-                    x11->buf_x++;
+        /* Xlib may already have read events off the connection, select()
+         * wouldn't tell us about those. */
+        bool pending = XPending(dpy) > 0;
 
-                    if (x11->buf_x >= x11->buf_w) {
-                        just_wrapped = true;
-                        x11->buf_x = x11->buf_w-1;
-                    }
-                }
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = pending ? 0 : 1000000;
+
+        if (syncing && !pending)
+            timeout.tv_usec = sync_left * 1000;
+
+        // a control client whose wait-for-text runs out before that
+        bool waiting = wait_left != -1 && !pending &&
+                       (!(blinking || syncing) ||
+                        wait_left * 1000 < timeout.tv_usec);
+        if (waiting) {
+            timeout.tv_sec  = wait_left / 1000;
+            timeout.tv_usec = wait_left % 1000 * 1000;
+        }
 
-                if (add_newline) {
-                    add_newline = false;
-                    draw = true;
-                    printf("Adding newline\n");
-                    x11->buf_x = 0;
-                    x11->buf_y++;
+        int num = select(maxfd + 1,
+                         &readable,
+                         &writable,
+                         NULL,
+                         blinking || pending || syncing || waiting
+                             ? &timeout
+                             : NULL);
+        if (num == 0 && (syncing || waiting)) {
+            continue;
+        }
+        else if (num == 0 && !pending) {
+            for (size_t i = 0; i < tabs_len; i++) {
+                struct X11 *x11 = &tabs[i]->x11;
 
-                    if (x11->buf_y > x11->scr_end) {
-                        scroll_up(x11);
-                        x11->buf_y = x11->scr_end;
-                    }
+                if (x11->active && x11_cursor_blinks(x11)) {
+                    x11->blink = !x11->blink;
+                    x11_draw_cursor(x11);
                 }
             }
-            
-            if(draw){
-                x11->blink = true;
-                x11_redraw(x11);
+            continue;
+        }
+        else if (num == -1) {
+            perror("select");
+            return 1;
+        }
+
+        // input first, it's what the user is waiting for
+        if (FD_ISSET(x11_shared.fd, &readable) || pending) {
+            while (XPending(dpy)) {
+                XNextEvent(dpy, &ev);
+                x11_event(&ev);
             }
         }
 
-        if (FD_ISSET(x11->fd, &readable)) {
-            while (XPending(x11->dpy)) {
-                XNextEvent(x11->dpy, &ev);
-                switch (ev.type) {
-                  case Expose:
-                    dirty_all_cells(x11);
-                    x11_redraw(x11);
-                    break;
-                  case KeyPress:
-                    x11_key(&ev.xkey, pty, x11);
+        // as much of what's been pasted as the shell takes
+        for (size_t i = 0; i < tabs_len; i++) {
+            struct tab *t = tabs[i];
+
+            if (t->paste_off == t->paste_len ||
+                !FD_ISSET(t->pty.master, &writable))
+                continue;
+
+            ssize_t n = write(t->pty.master, t->paste + t->paste_off,
+                              t->paste_len - t->paste_off);
+            if (n > 0)
+                t->paste_off += n;
+
+            // a big paste doesn't get to keep its buffer
+            if (t->paste_off == t->paste_len) {
+                free(t->paste);
+                t->paste     = NULL;
+                t->paste_len = t->paste_off = t->paste_cap = 0;
+            }
+        }
+
+        for (size_t i = 0; i < tabs_len; i++) {
+            struct tab *t = tabs[i];
+
+            if (!FD_ISSET(t->pty.master, &readable))
+                continue;
+
+            ssize_t num = read(t->pty.master, _buf, sizeof(_buf));
+
+            /* EAGAIN: the tab was opened during this very iteration and
+             * got the fd of one that's been closed, nothing to read. */
+            if (num == -1 && errno == EAGAIN)
+                continue;
+
+            if (num == -1) {
+                // the shell is gone
+                tab_close(i--);
+                continue;
+            }
+
+            /* Take all there is (the master is non-blocking), the more
+             * we see at once, the more jump_scroll() can skip. */
+            while ((size_t)num < sizeof(_buf)) {
+                ssize_t more = read(t->pty.master, _buf + num,
+                                    sizeof(_buf) - num);
+                if (more <= 0)
                     break;
-                }
+                num += more;
+            }
+
+            t->x11.last_activity = monotonic_seconds();
+
+            if (t->log != NULL)
+                log_write(t->log, _buf, num);
+
+            bool draw = t->scan != NULL ? trigger_feed(t, _buf, num)
+                                        : tab_feed(t, _buf, num);
+            if (draw && !t->x11.sync_update) {
+                export_update(t);
+                t->x11.blink = true;
+                x11_redraw(&t->x11);
             }
         }
 
-        if (FD_ISSET(0, &readable)) {
+        for (size_t i = 0; i < daemon_clients_len; i++)
+            if (FD_ISSET(daemon_clients[i]->fd, &readable) && !daemon_read(i))
+                i--;
+
+        if (listen_fd != -1 && FD_ISSET(listen_fd, &readable))
+            daemon_accept(listen_fd);
+
+        for (size_t i = 0; i < controls_len; i++)
+            if (FD_ISSET(controls[i]->fd, &readable))
+                control_read(controls[i]);
+
+        if (control_fd != -1 && FD_ISSET(control_fd, &readable))
+            control_accept();
+
+        if (stdin_open && FD_ISSET(0, &readable)) {
             printf("Stdin became readable\n");
             char   buf[1024];
             size_t n;
+            size_t shown;
 
             n = read(0, buf, sizeof(buf));
 
+            // goes to the first tab on screen, if any
+            for (shown = 0; shown < tabs_len; shown++)
+                if (tabs[shown]->x11.active)
+                    break;
+
             if (n != 0) {
                 printf("Stdin read %zu chars\n", n);
-                for (size_t i = 0; i < n; i++) {
-                    int ignore = write(pty->master, &buf[i], 1);
+                for (size_t i = 0; i < n && shown < tabs_len; i++) {
+                    int ignore = write(tabs[shown]->pty.master, &buf[i], 1);
                     (void)ignore;
                 }
             }
             else {
                 printf("Stdin closed\n");
-                FD_CLR(0, &active);
+                stdin_open = false;
             }
         }
+
+        if (tabs_len == 0 && listen_fd == -1)
+            return 0;
+    }
+
+    return 0;
+}
+
+/* Feeds a file to the parser of a terminal that has neither a window
+ * nor a shell, in chunks of the size a pty read gives us, and reports
+ * how fast that went. This is what "make pgo" trains on: the parser
+ * running over real output, no X server needed. */
+int replay(const char *path)
+{
+    struct tab *t = calloc(1, sizeof(*t));
+    FILE       *f;
+    char        buf[4096];
+    size_t      n, total = 0;
+    long        start, ms;
+
+    if (t == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    if (!term_setup(&t->x11))
+        return 1;
+    t->pty.master = -1;  // answers to queries go nowhere
+
+    if (triggers_len > 0 && (t->scan = trigger_scan_new()) == NULL)
+        return 1;
+
+    start = monotonic_ms();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        if (t->scan != NULL)
+            trigger_feed(t, buf, n);
+        else
+            tab_feed(t, buf, n);
+        total += n;
+    }
+    ms = monotonic_ms() - start;
+
+    if (ferror(f)) {
+        perror(path);
+        return 1;
     }
+    fclose(f);
 
+    fprintf(stderr, "%s: %zu bytes in %.3f s, %.1f MB/s\n", path, total,
+            ms / 1e3, ms > 0 ? total / 1e3 / ms : 0.0);
+
+    if (t->scan != NULL)
+        trigger_scan_free(t->scan);
+    term_free(&t->x11);
+    free(t);
     return 0;
 }
+
 const char *argp_program_version =
   "eduterm 1.0";
 const char *argp_program_bug_address =
@@ -1551,19 +6415,53 @@ const char *argp_program_bug_address =
 static char doc[] =
   "Eduterm -- James' extention to the eduterm source";
 
+// options without a short form
+enum {
+    OPT_LOG_TEXT = 256,
+    OPT_LOG_SIZE,
+    OPT_CONTROL,
+    OPT_OPEN,
+};
+
 /* The options we understand. */
 static struct argp_option options[] = {
   {"exit-on-unknown",  'e', 0, 0, "Exit on unknown operations", 0},
   {"print-child",  'p', 0, 0, "Print child output", 0},
+  {"blink-idle",  'b', "SECONDS", 0,
+   "Stop blinking the cursor after SECONDS without input or output "
+   "(default 30, 0 blinks forever)", 0},
+  {"daemon",  'd', 0, 0,
+   "Keep running without windows and open them for --client", 0},
+  {"client",  'c', 0, 0,
+   "Have the daemon open a window instead of starting up on our own", 0},
+  {"exec",  'x', "COMMAND", 0,
+   "Run COMMAND (with /bin/sh -c) instead of a login shell", 0},
+  {"geometry",  'g', "COLSxROWS", 0, "Size of the terminal (default 80x45)", 0},
+  {"replay",  'r', "FILE", 0,
+   "Feed FILE to the parser, without X or a shell, report the time it "
+   "took and exit", 0},
+  {"triggers",  't', "FILE", 0,
+   "Look for the patterns in FILE in the output and act on them", 0},
+  {"log",  'l', "FILE", 0,
+   "Copy everything the shell sends to FILE (FILE-2, FILE-3, ... for "
+   "more tabs)", 0},
+  {"log-text",  OPT_LOG_TEXT, 0, 0,
+   "Leave escape sequences and control characters out of the log", 0},
+  {"log-size",  OPT_LOG_SIZE, "SIZE", 0,
+   "Rotate the log when it reaches SIZE bytes, k, M or G may follow "
+   "(default 64M, 0 never)", 0},
+  {"control",  OPT_CONTROL, "PATH", 0,
+   "Take commands from scripts on the Unix socket PATH", 0},
+  {"open",  OPT_OPEN, "COMMAND", 0,
+   "Open links (Ctrl+Shift+O) with COMMAND, run with /bin/sh -c: $1 is "
+   "the URL or file, $2 and $3 the line and column (default: xdg-open "
+   "\"$1\")", 0},
   { 0 }
 };
 
 static error_t
 parse_opt(int key, char* arg, struct argp_state *state)
 {
-  (void) arg;
-  (void) state;
-
   switch(key) {
     case 'e': {
       exit_mode = true;
@@ -1571,6 +6469,64 @@ parse_opt(int key, char* arg, struct argp_state *state)
     case 'p': {
       print_child = true;
     } break;
+    case 'd': {
+      daemon_mode = true;
+    } break;
+    case 'c': {
+      client_mode = true;
+    } break;
+    case 'x': {
+      exec_cmd = arg;
+    } break;
+    case 'r': {
+      replay_file = arg;
+    } break;
+    case 't': {
+      triggers_file = arg;
+    } break;
+    case 'l': {
+      log_path = arg;
+    } break;
+    case OPT_LOG_TEXT: {
+      log_text = true;
+    } break;
+    case OPT_LOG_SIZE: {
+      char     *end;
+      long long size  = strtoll(arg, &end, 10);
+      int       shift = 0;
+      if (*end == 'k' || *end == 'K')
+        shift = 10;
+      else if (*end == 'M')
+        shift = 20;
+      else if (*end == 'G')
+        shift = 30;
+      if (shift > 0)
+        end++;
+      if (end == arg || *end != '\0' || size < 0 ||
+          size > (LLONG_MAX >> shift))
+        argp_error(state, "invalid log size '%s'", arg);
+      log_max = size << shift;
+    } break;
+    case OPT_CONTROL: {
+      control_path = arg;
+    } break;
+    case OPT_OPEN: {
+      open_cmd = arg;
+    } break;
+    case 'g': {
+      char x;
+      if (sscanf(arg, "%d%c%d", &term_cols, &x, &term_rows) != 3 ||
+          x != 'x' || term_cols < 1 || term_rows < 1 ||
+          term_cols > CSI_MAX_VALUE || term_rows > CSI_MAX_VALUE)
+        argp_error(state, "invalid geometry '%s'", arg);
+    } break;
+    case 'b': {
+      char *end;
+      long  secs = strtol(arg, &end, 10);
+      if (*arg == '\0' || *end != '\0' || secs < 0)
+        argp_error(state, "invalid number of seconds '%s'", arg);
+      blink_idle = secs;
+    } break;
     default:
       return ARGP_ERR_UNKNOWN;
   }
@@ -1584,20 +6540,41 @@ int main(int argc, char* argv[])
 {
     argp_parse(&argp, argc, argv, 0, 0, 0);
 
-    struct PTY pty;
-    struct X11 x11;
+    if (client_mode)
+        return client();
 
-    if (!x11_setup(&x11))
+    if (triggers_file != NULL && !trigger_load(triggers_file))
         return 1;
 
-    if (!pt_pair(&pty))
-        return 1;
+    if (replay_file != NULL)
+        return replay(replay_file);
 
-    if (!term_set_size(&pty, &x11))
+    // we don't care how the shells exit, so don't keep zombies for that
+    signal(SIGCHLD, SIG_IGN);
+
+    if (!x11_setup(&x11_shared))
         return 1;
 
-    if (!spawn(&pty))
+    if (log_path != NULL)
+        atexit(tab_close_logs);
+
+    if (control_path != NULL) {
+        control_fd = control_listen(control_path);
+        if (control_fd == -1)
+            return 1;
+        setenv("EDUTERM_CONTROL", control_path, 1);
+    }
+
+    if (daemon_mode) {
+        int fd = daemon_listen();
+        if (fd == -1)
+            return 1;
+        return run(fd);
+    }
+
+    if (tab_open(NULL, NULL) == NULL)
         return 1;
+    tab_show(0);
 
-    return run(&pty, &x11);
+    return run(-1);
 }
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Generates width.h, the table glyph_width() in eduterm.c looks at.
+
+Every code point gets a width of 0, 1 or 2 cells. Four of those fit into
+a byte. The code points are split into blocks of 256 and identical
+blocks are only stored once: stage1 maps "code point >> 8" to a block,
+stage2 holds the blocks. That's a few KiB instead of 1.1 MB, and a
+lookup is two loads and a shift.
+
+The data comes from Python's unicodedata module, so the table follows
+whatever Unicode version the Python that runs this script was built
+with."""
+
+import sys
+import unicodedata
+
+MAX_CP = 0x110000
+BLOCK = 256
+
+
+def width(cp):
+    ch = chr(cp)
+    cat = unicodedata.category(ch)
+
+    # Soft hyphen is printed, everybody else agrees on that
+    if cp == 0x00AD:
+        return 1
+    # Combining marks and format characters (ZWJ, ZWNJ, ...)
+    if cat in ("Mn", "Me", "Cf"):
+        return 0
+    # Hangul Jamo medial vowels and final consonants
+    if 0x1160 <= cp <= 0x11FF:
+        return 0
+    if unicodedata.east_asian_width(ch) in ("W", "F"):
+        return 2
+    # Unassigned code points of the CJK planes are wide by default
+    if cat == "Cn" and (0x20000 <= cp <= 0x2FFFD or 0x30000 <= cp <= 0x3FFFD):
+        return 2
+    return 1
+
+
+def main():
+    blocks = []
+    index = {}
+    stage1 = []
+
+    for base in range(0, MAX_CP, BLOCK):
+        packed = bytearray(BLOCK // 4)
+        for i in range(BLOCK):
+            packed[i // 4] |= width(base + i) << ((i % 4) * 2)
+        packed = bytes(packed)
+        if packed not in index:
+            index[packed] = len(blocks)
+            blocks.append(packed)
+        stage1.append(index[packed])
+
+    if len(blocks) > 256:
+        sys.exit("mkwidth.py: too many distinct blocks for a byte index")
+
+    out = sys.stdout
+    out.write("/* Generated by mkwidth.py from Unicode %s, do not edit. */\n\n"
+              % unicodedata.unidata_version)
+    out.write("#define WIDTH_BLOCK_SHIFT %d\n\n" % (BLOCK.bit_length() - 1))
+    out.write("static const unsigned char width_stage1[%d] = {\n" % len(stage1))
+    for i in range(0, len(stage1), 16):
+        out.write("    " + ", ".join("%3d" % v for v in stage1[i:i + 16]) +
+                  ",\n")
+    out.write("};\n\n")
+    out.write("static const unsigned char width_stage2[%d][%d] = {\n"
+              % (len(blocks), BLOCK // 4))
+    for b in blocks:
+        out.write("    {\n")
+        for i in range(0, len(b), 16):
+            out.write("        " +
+                      ", ".join("0x%02x" % v for v in b[i:i + 16]) + ",\n")
+        out.write("    },\n")
+    out.write("};\n")
+
+
+if __name__ == "__main__":
+    main()
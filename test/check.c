@@ -0,0 +1,341 @@
+/* Checks of the parts of eduterm that don't need an X server: fast paths
+ * against the slow ones they stand in for, and helpers that are easy to
+ * get subtly wrong. Prints what fails and exits with 1 if anything did.
+ *
+ * eduterm prints a trace of what it does to stdout, so printf() and
+ * putchar() are stubbed out in the eduterm.c we include here, as in
+ * bench/micro.c. */
+#define _GNU_SOURCE
+#include <stdio.h>
+
+static int quiet_printf(const char *fmt, ...)
+{
+    (void)fmt;
+    return 0;
+}
+
+static int quiet_putchar(int c)
+{
+    return c;
+}
+
+#define printf  quiet_printf
+#define putchar quiet_putchar
+#define main    eduterm_main
+#include "../eduterm.c"
+#undef main
+#undef printf
+#undef putchar
+
+#define COLS 20
+#define ROWS 6
+
+static int failures;
+
+static void fail(const char *what, const char *detail)
+{
+    fprintf(stderr, "FAIL %s: %s\n", what, detail);
+    failures++;
+}
+
+static struct tab *tab_new(void)
+{
+    struct tab *t = calloc(1, sizeof(*t));
+
+    term_cols = COLS;
+    term_rows = ROWS;
+    if (t == NULL || !term_setup(&t->x11))
+        exit(1);
+    t->pty.master = -1;
+    return t;
+}
+
+static void tab_free(struct tab *t)
+{
+    term_free(&t->x11);
+    free(t);
+}
+
+static void feed(struct tab *t, const char *s, size_t n, bool jump)
+{
+    print_child = !jump;  // which also turns jump scroll off
+    tab_feed(t, s, n);
+    print_child = false;
+}
+
+// the same cells, colors and all, and the cursor in the same place
+static bool same_screen(const struct X11 *a, const struct X11 *b)
+{
+    if (a->buf_x != b->buf_x || a->buf_y != b->buf_y)
+        return false;
+
+    for (int y = 0; y < a->buf_h; y++) {
+        for (int x = 0; x < a->buf_w; x++) {
+            const struct cell *ca = a->rows[y]->cells + x;
+            const struct cell *cb = b->rows[y]->cells + x;
+
+            if (ca->g != cb->g || ca->fg != cb->fg || ca->bg != cb->bg ||
+                ca->bold != cb->bold || ca->wide != cb->wide)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/* Jump scroll has to leave the screen just as parsing everything would,
+ * wherever the cursor is and whatever is on the screen before. Lines
+ * exactly as wide as the screen are in there, for the newline after them
+ * that the parser ignores, and so is a cursor that has just wrapped. */
+static void check_jump_scroll(void)
+{
+    static const char *lines[] = {
+        "ab", "", "a much longer line", "\33[31mred\33[m", "\33[44mblue",
+        "x\33[Ky", "\33[1mbold\33[22m and not", "exactly twenty chars",
+        "", "exactly twenty\33[mchars", "exactly twenty chars\33[m",
+        "caf\xc3\xa9", "a\tb", "exactly twenty chars\r",
+        "more than twenty chars",
+    };
+    char buf[8192], what[128];
+
+    for (int cy = 0; cy < ROWS; cy++) {
+        for (int nl = ROWS - 2; nl <= 3 * ROWS + 2; nl++) {
+            for (int style = 0; style < 6; style++) {
+                struct tab *a = tab_new(), *b = tab_new();
+                size_t      n = 0;
+
+                // something on every row, then the cursor to row cy
+                for (int y = 0; y < ROWS; y++)
+                    n += sprintf(buf + n, "\33[%d;1Hxxxxxxxxxxxxxx%d", y + 1,
+                                 y);
+                n += sprintf(buf + n, "\33[%d;3H", cy + 1);
+                // or right after the last column, about to wrap
+                if (style >= 3)
+                    n += sprintf(buf + n, "\33[%d;%dHzz", cy + 1, COLS - 1);
+                feed(a, buf, n, false);
+                feed(b, buf, n, false);
+
+                n = 0;
+                for (int i = 0; i < nl; i++) {
+                    if (style % 3 == 0)
+                        n += sprintf(buf + n, "\n");
+                    else
+                        n += sprintf(buf + n, "%s%s\n",
+                                     lines[(i + cy) % (sizeof(lines) /
+                                                       sizeof(lines[0]))],
+                                     style % 3 == 2 ? "\r" : "");
+                }
+                n += sprintf(buf + n, "ab");
+
+                feed(a, buf, n, false);
+                feed(b, buf, n, true);
+
+                if (!same_screen(&a->x11, &b->x11)) {
+                    snprintf(what, sizeof(what),
+                             "cursor on row %d, %d lines, style %d", cy, nl,
+                             style);
+                    fail("jump_scroll", what);
+                }
+
+                tab_free(a);
+                tab_free(b);
+            }
+        }
+    }
+}
+
+/* The literal a regex's matches all contain, which gates it: if it's
+ * wrong, the trigger never fires. */
+static void check_regex_literal(void)
+{
+    static const struct {
+        const char *re, *literal;  // NULL for none
+    } cases[] = {
+        {"error", "error"},
+        {"FAIL(ED)?: [a-z_]+", "FAIL"},
+        {"x{2}error", "error"},
+        {"ab{2,3}cdefg", "cdefg"},
+        {"[[:digit:]]abc", "abc"},
+        {"[^[:space:]]+xyz", "xyz"},
+        {"[[=e=][.-.]]warning", "warning"},
+        {"[]a]bcd", "bcd"},
+        {"a\\.out:", "a.out:"},
+        {"colou?r", "colo"},
+        {"one|two", NULL},
+        {"[0-9]+:[0-9]+", NULL},
+    };
+    char what[256];
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char *lit = regex_literal(cases[i].re);
+
+        if ((lit == NULL) != (cases[i].literal == NULL) ||
+            (lit != NULL && strcmp(lit, cases[i].literal) != 0)) {
+            snprintf(what, sizeof(what), "/%s/ gave \"%s\", not \"%s\"",
+                     cases[i].re, lit != NULL ? lit : "(none)",
+                     cases[i].literal != NULL ? cases[i].literal : "(none)");
+            fail("regex_literal", what);
+        }
+        free(lit);
+    }
+}
+
+/* Pasted text mustn't get out of bracketed paste: the ESC of a pasted
+ * end marker goes, the real markers stay. Without brackets, it's all
+ * passed on. */
+static void check_paste(void)
+{
+    static const char text[] = "a\33[201~rm -rf ~\n";
+    static const struct {
+        bool        bracketed;
+        const char *queued;
+    } cases[] = {
+        {true, "\33[200~a[201~rm -rf ~\r\33[201~"},
+        {false, "a\33[201~rm -rf ~\r"},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        struct tab *t = tab_new();
+
+        t->x11.bracketed_paste = cases[i].bracketed;
+        paste_bracket(t, false);
+        paste_queue(t, text, sizeof(text) - 1, false);
+        paste_bracket(t, true);
+
+        if (t->paste_len != strlen(cases[i].queued) ||
+            memcmp(t->paste, cases[i].queued, t->paste_len) != 0)
+            fail("paste_queue", cases[i].bracketed ? "bracketed"
+                                                   : "not bracketed");
+
+        free(t->paste);
+        tab_free(t);
+    }
+}
+
+/* What was copied is still there once the screen it came from is
+ * resized or gone, blank rows included: they're all the same row,
+ * which the screen replaces in both cases. */
+static void check_sel_source(void)
+{
+    static const char text[] = "one\r\n\r\nthree", want[] = "one\n\nthree";
+
+    for (int gone = 0; gone < 2; gone++) {
+        struct tab        *t = tab_new();
+        struct sel_source *src;
+        char               out[1024];
+        int                row = 0;
+        size_t             n;
+
+        feed(t, text, sizeof(text) - 1, false);
+        t->x11.sel_mode = SEL_LINE;
+        t->x11.sel_ax   = t->x11.sel_bx = 0;
+        t->x11.sel_ay   = 0;
+        t->x11.sel_by   = 2;
+        sel_update(&t->x11);
+        src = sel_selected(&t->x11);
+        if (src == NULL)
+            exit(1);
+
+        if (gone)
+            term_free(&t->x11);
+        else
+            term_resize(&t->x11, COLS / 2, ROWS / 2);
+
+        n = sel_read(src, &row, out, sizeof(out));
+        if (n != strlen(want) || memcmp(out, want, n) != 0)
+            fail("sel_source", gone ? "screen gone" : "screen resized");
+        sel_source_unref(src);
+
+        if (gone)
+            free(t);
+        else
+            tab_free(t);
+    }
+}
+
+/* After each update, the export has to show what's on the screen, even
+ * though only rows that changed are copied. */
+static void check_export(void)
+{
+    static const char *chunks[] = {
+        "hello\r\nworld", "\33[1;3Hy", "\n\n\n\n\n\n\nscrolled",
+        "\33[2;1H\33[2L", "\33[3;4H\33[K", "\33[41m\33[2J",
+        "\33[m\33[6;1H\33[1mbold\33[22m \xe4\xb8\xad", "\33[2;5H\33[3M",
+        "abc", "1\r\n2\r\n3\r\n4\r\n5\r\n6\r\n7\r\n8",
+        "\33[2;5r\33[5;1Hx\ny\nz\n\33[r", "\33[1;1H\33M\33M", "\33[2S",
+        "\33[3T", "\33[6;1H\n\n\n",
+    };
+    struct tab *t = tab_new();
+    char        what[64];
+    int         fd = export_open(t);
+
+    if (fd == -1)
+        exit(1);
+    close(fd);
+
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        const struct export_cell *ec = (struct export_cell *)(t->export + 1);
+
+        feed(t, chunks[i], strlen(chunks[i]), false);
+        export_update(t);
+
+        for (int y = 0; y < ROWS; y++) {
+            for (int x = 0; x < COLS; x++, ec++) {
+                const struct cell *c = t->x11.rows[y]->cells + x;
+
+                if (ec->g != (c->wdummy ? 0 : (uint32_t)c->g) ||
+                    ec->fg != c->fg || ec->bg != c->bg ||
+                    !(ec->attr & EXPORT_BOLD) != !c->bold) {
+                    snprintf(what, sizeof(what), "after chunk %zu, %d,%d",
+                             i, x, y);
+                    fail("export_update", what);
+                    y = ROWS;
+                    break;
+                }
+            }
+        }
+    }
+
+    export_close(t);
+    tab_free(t);
+}
+
+/* The link under the pointer is rewritten in place, to one just as long
+ * but with its line number somewhere else: that's where link_open()
+ * must split it now. */
+static void check_link_hover(void)
+{
+    static const char *text[] = {"a.c:1234", "\33[1;1Ha.cc:123"};
+    static const int   colon[] = {3, 4};
+    struct tab        *t = tab_new();
+
+    t->x11.pointer_x = 2;
+    t->x11.pointer_y = 0;
+    for (int i = 0; i < 2; i++) {
+        feed(t, text[i], strlen(text[i]), false);
+        t->x11.links[0].stale = true;  // as drawing it would
+        link_hover(&t->x11);
+
+        if (t->x11.hover_y != 0 || t->x11.hover.colon != colon[i])
+            fail("link_hover", i == 0 ? "first link" : "link rewritten");
+    }
+
+    tab_free(t);
+}
+
+int main(void)
+{
+    check_jump_scroll();
+    check_regex_literal();
+    check_paste();
+    check_sel_source();
+    check_export();
+    check_link_hover();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    fprintf(stderr, "all checks passed\n");
+    return 0;
+}